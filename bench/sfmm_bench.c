@@ -0,0 +1,593 @@
+/*
+ * Trace replay benchmark for sfmm.
+ *
+ * A trace is a text file with one operation per line:
+ *
+ *     a <id> <size>           allocate size bytes and call the block id
+ *     m <id> <size> <align>   allocate size bytes aligned to align and call the block id
+ *     r <id> <size>           resize block id to size bytes
+ *     f <id>                  free block id
+ *
+ * Lines starting with # are comments.  Ids are small non-negative integers and may be
+ * reused once their block is freed.  Binary traces recorded by a build of sfmm with
+ * SF_TRACE (see sf_trace_record in sfmm_util.h) are recognized by their header and
+ * replayed the same way.
+ *
+ * Every trace is replayed against sfmm and against the C library allocator, each run in
+ * its own child process so that it starts from an empty heap.  One run has no timers and
+ * gives the throughput; a second run times every operation for the latency percentiles
+ * and samples the heap size after each operation for the peak heap size.  Utilization is
+ * the peak of live requested bytes over the peak heap size.
+ *
+ * With -H ops, the timed run of sfmm also writes the shape of its heap (see sf_shape_dump) to
+ * stderr as one JSON object per line, every ops operations and after the last one, for
+ * graphing fragmentation over the course of the trace.
+ *
+ * Usage:
+ *     sfmm_bench [-a sfmm|libc] [-H ops] trace...
+ *                                             replay traces (both allocators by default)
+ *     sfmm_bench -g churn|grow|mixed|large [-n ops] [-s seed]
+ *                                             write a synthetic trace to stdout
+ */
+#define _DEFAULT_SOURCE //for clock_gettime and fork
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "sfmm.h"
+#include "sfmm_util.h"
+
+#define TRUE (1)
+#define FALSE (0)
+
+typedef struct {
+    char type;    // One of a, m, r, f.
+    size_t id;
+    size_t size;
+    size_t align;
+} trace_op;
+
+typedef struct {
+    const char *path;
+    trace_op *ops;
+    size_t numOps;
+    size_t capacity;     // Length of the ops array.
+    size_t numIds;       // One more than the largest id.
+    size_t peakLive;     // Largest number of requested bytes live at once.
+} trace;
+
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*memalign)(size_t size, size_t align);
+    size_t (*heapSize)();
+    void (*dumpHeap)(FILE *out); // NULL if the allocator cannot describe its heap.
+} allocator;
+
+typedef struct {
+    int ok;
+    size_t failedOp;     // Index of the operation that returned NULL when ok is false.
+    double seconds;
+    size_t peakHeap;
+    uint64_t latency[6]; // p50, p90, p99, p99.9, max and mean in nanoseconds.
+} run_result;
+
+static size_t sfmmHeapSize(){
+    sf_heap_stats stats = sf_stats();
+    return stats.heapSize + stats.mappedBytes;
+}
+
+static void sfmmDumpHeap(FILE *out){
+    sf_heap_shape shape = sf_shape();
+    sf_shape_dump(&shape, out);
+}
+
+static void *libcMemalign(size_t size, size_t align){
+    void *ptr = NULL;
+    return posix_memalign(&ptr, align, size) == 0 ? ptr : NULL;
+}
+
+static size_t libcHeapSize(){
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+
+static allocator allocators[] = {
+    {"sfmm", sf_malloc, sf_free, sf_realloc, sf_memalign, sfmmHeapSize, sfmmDumpHeap},
+    {"libc", malloc, free, realloc, libcMemalign, libcHeapSize, NULL},
+};
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+static size_t shapeInterval = 0; //operations between heap shapes written with -H, 0 for none
+
+//The benchmark's own arrays are mapped directly so they never show up in either allocator's heap
+static void *mapArray(size_t count, size_t elementSize){
+    size_t bytes = count * elementSize > 0 ? count * elementSize : 1;
+    void *ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED){
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static void unmapArray(void *ptr, size_t count, size_t elementSize){
+    munmap(ptr, count * elementSize > 0 ? count * elementSize : 1);
+}
+
+static uint64_t nowNanos(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+//Parse the operations of a text trace
+static int parseTextTrace(FILE *file, trace *t){
+    char line[256];
+    size_t capacity = 0;
+    while(fgets(line, sizeof(line), file) != NULL){
+        capacity++;
+    }
+    rewind(file);
+    t -> capacity = capacity;
+    t -> ops = mapArray(capacity, sizeof(trace_op));
+
+    size_t lineNumber = 0;
+    while(fgets(line, sizeof(line), file) != NULL){
+        lineNumber++;
+        if(line[0] == '#' || line[0] == '\n'){
+            continue;
+        }
+        trace_op op = {0};
+        int fields = sscanf(line, " %c %zu %zu %zu", &op.type, &op.id, &op.size, &op.align);
+        int expected = op.type == 'f' ? 2 : op.type == 'm' ? 4 : 3;
+        if(fields < expected || (op.type != 'a' && op.type != 'm' && op.type != 'r' && op.type != 'f')){
+            fprintf(stderr, "%s:%zu: malformed operation\n", t -> path, lineNumber);
+            return FALSE;
+        }
+        t -> ops[t -> numOps++] = op;
+        if(op.id + 1 > t -> numIds){
+            t -> numIds = op.id + 1;
+        }
+    }
+    return TRUE;
+}
+
+#define EMPTY_SLOT 0   //no block payload lives at address 0 or 1, so both can mark table slots
+#define DELETED_SLOT 1
+
+typedef struct {
+    uint64_t address;
+    size_t id;
+} address_slot;
+
+//Find the slot holding address in an open addressing table, or the slot where it should be inserted
+static address_slot *findAddress(address_slot *table, size_t mask, uint64_t address){
+    address_slot *insertAt = NULL;
+    for(size_t i = (address >> 4) * 0x9e3779b97f4a7c15u & mask; ; i = (i + 1) & mask){
+        if(table[i].address == address){
+            return &table[i];
+        }
+        if(table[i].address == DELETED_SLOT && insertAt == NULL){
+            insertAt = &table[i];
+        }else if(table[i].address == EMPTY_SLOT){
+            return insertAt != NULL ? insertAt : &table[i];
+        }
+    }
+}
+
+/*
+ * Turn a binary trace recorded by an SF_TRACE build into operations, giving every live address an id
+ * and reusing the ids of freed blocks.  Calls that failed and frees of addresses the trace never
+ * returned are dropped.  A realloc that moved its block in a threaded program can have its record land
+ * after a malloc in another thread that got the old address back; the newer block takes the address.
+ */
+static int parseBinaryTrace(FILE *file, trace *t){
+    sf_trace_header header;
+    if(fread(&header, sizeof(header), 1, file) != 1 || header.recordSize != sizeof(sf_trace_record)){
+        fprintf(stderr, "%s: unsupported trace record size\n", t -> path);
+        return FALSE;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t capacity = (ftell(file) - sizeof(header)) / sizeof(sf_trace_record);
+    fseek(file, sizeof(header), SEEK_SET);
+    t -> capacity = 2 * capacity; //a record can also add a free the trace did not show
+    t -> ops = mapArray(t -> capacity, sizeof(trace_op));
+
+    size_t tableSize = 16;
+    while(tableSize < 2 * capacity){
+        tableSize *= 2;
+    }
+    address_slot *table = mapArray(tableSize, sizeof(address_slot));
+    size_t *freeIds = mapArray(capacity, sizeof(size_t));
+    size_t numFreeIds = 0;
+
+    sf_trace_record record;
+    while(fread(&record, sizeof(record), 1, file) == 1){
+        trace_op op = {0};
+        address_slot *slot = NULL;
+        if(record.op == SF_TRACE_FREE || (record.op == SF_TRACE_REALLOC && record.ptr != 0)){
+            slot = findAddress(table, tableSize - 1, record.ptr);
+            if(slot -> address != record.ptr){
+                continue;
+            }
+            op.id = slot -> id;
+        }
+
+        if(record.op == SF_TRACE_REALLOC && slot != NULL && record.size == 0){
+            op.type = 'f'; //realloc to 0 bytes frees the block
+        }else if(record.op == SF_TRACE_FREE){
+            op.type = 'f';
+        }else if(record.result == 0){
+            continue;
+        }else if(slot != NULL){
+            op.type = 'r';
+        }else{
+            op.type = record.op == SF_TRACE_MEMALIGN ? 'm' : 'a';
+            op.id = numFreeIds > 0 ? freeIds[--numFreeIds] : t -> numIds;
+        }
+        op.size = record.size;
+        op.align = record.align;
+
+        if(slot != NULL){
+            slot -> address = DELETED_SLOT;
+        }
+        if(op.type == 'f'){
+            freeIds[numFreeIds++] = op.id;
+        }else{
+            address_slot *resultSlot = findAddress(table, tableSize - 1, record.result);
+            if(resultSlot -> address == record.result && resultSlot -> id != op.id){
+                freeIds[numFreeIds++] = resultSlot -> id; //the older block's free was never seen
+                t -> ops[t -> numOps++] = (trace_op) {'f', resultSlot -> id, 0, 0};
+            }
+            resultSlot -> address = record.result;
+            resultSlot -> id = op.id;
+        }
+        t -> ops[t -> numOps++] = op;
+        if(op.id + 1 > t -> numIds){
+            t -> numIds = op.id + 1;
+        }
+    }
+    unmapArray(table, tableSize, sizeof(address_slot));
+    unmapArray(freeIds, capacity, sizeof(size_t));
+    return TRUE;
+}
+
+//Load a text or binary trace, returns false and prints why if the file cannot be read or is malformed
+static int loadTrace(const char *path, trace *t){
+    FILE *file = fopen(path, "r");
+    if(file == NULL){
+        perror(path);
+        return FALSE;
+    }
+    memset(t, 0, sizeof(*t));
+    t -> path = path;
+    uint64_t magic = 0;
+    int binary = fread(&magic, sizeof(magic), 1, file) == 1 && magic == SF_TRACE_MAGIC;
+    rewind(file);
+    int ok = binary ? parseBinaryTrace(file, t) : parseTextTrace(file, t);
+    fclose(file);
+    if(!ok){
+        if(t -> ops != NULL){
+            unmapArray(t -> ops, t -> capacity, sizeof(trace_op));
+        }
+        return FALSE;
+    }
+
+    //replay the sizes alone to find the peak live bytes
+    size_t *sizes = mapArray(t -> numIds, sizeof(size_t));
+    size_t live = 0;
+    for(size_t i = 0; i < t -> numOps; i++){
+        trace_op *op = &t -> ops[i];
+        live -= sizes[op -> id];
+        sizes[op -> id] = op -> type == 'f' ? 0 : op -> size;
+        live += sizes[op -> id];
+        if(live > t -> peakLive){
+            t -> peakLive = live;
+        }
+    }
+    unmapArray(sizes, t -> numIds, sizeof(size_t));
+    return TRUE;
+}
+
+//Replay a trace once. When latencies is not null every operation is timed and the heap size is
+//sampled after it, outside of the timed region, as is the heap shape with -H.
+static void replay(trace *t, allocator *a, uint64_t *latencies, run_result *result){
+    void **blocks = mapArray(t -> numIds, sizeof(void *));
+    result -> ok = TRUE;
+    uint64_t start = nowNanos();
+    for(size_t i = 0; i < t -> numOps; i++){
+        trace_op *op = &t -> ops[i];
+        uint64_t opStart = latencies != NULL ? nowNanos() : 0;
+        void *ptr = NULL;
+        switch(op -> type){
+            case 'a':
+                ptr = a -> malloc(op -> size);
+                break;
+            case 'm':
+                ptr = a -> memalign(op -> size, op -> align);
+                break;
+            case 'r':
+                ptr = a -> realloc(blocks[op -> id], op -> size);
+                break;
+            case 'f':
+                a -> free(blocks[op -> id]);
+                break;
+        }
+        if(latencies != NULL){
+            latencies[i] = nowNanos() - opStart;
+            size_t heap = a -> heapSize();
+            if(heap > result -> peakHeap){
+                result -> peakHeap = heap;
+            }
+            if(a -> dumpHeap != NULL && shapeInterval != 0 && ((i + 1) % shapeInterval == 0 || i + 1 == t -> numOps)){
+                a -> dumpHeap(stderr);
+            }
+        }
+        if(op -> type != 'f' && ptr == NULL && op -> size != 0){
+            result -> ok = FALSE;
+            result -> failedOp = i;
+            break;
+        }
+        blocks[op -> id] = ptr;
+        if(ptr != NULL){
+            *(char *) ptr = (char) i; //touch the block like a real caller would
+        }
+    }
+    result -> seconds = (nowNanos() - start) / 1e9;
+    unmapArray(blocks, t -> numIds, sizeof(void *));
+}
+
+static int compareLatencies(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+//Run both passes of a trace against one allocator, each in a fresh child process
+static void measure(trace *t, allocator *a, run_result *result){
+    for(int timed = FALSE; timed <= TRUE; timed++){
+        int fds[2];
+        if(pipe(fds) != 0){
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        pid_t pid = fork();
+        if(pid == 0){
+            close(fds[0]);
+            run_result child = {0};
+            uint64_t *latencies = timed ? mapArray(t -> numOps, sizeof(uint64_t)) : NULL;
+            replay(t, a, latencies, &child);
+            if(timed && child.ok && t -> numOps > 0){
+                uint64_t total = 0;
+                for(size_t i = 0; i < t -> numOps; i++){
+                    total += latencies[i];
+                }
+                qsort(latencies, t -> numOps, sizeof(uint64_t), compareLatencies);
+                double percentiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+                for(int i = 0; i < 5; i++){
+                    child.latency[i] = latencies[(size_t) (percentiles[i] * (t -> numOps - 1))];
+                }
+                child.latency[5] = total / t -> numOps;
+            }
+            sf_trace_flush(); //_exit skips the flush at exit when sfmm is built with SF_TRACE
+            if(write(fds[1], &child, sizeof(child)) != sizeof(child)){
+                _exit(EXIT_FAILURE);
+            }
+            _exit(EXIT_SUCCESS);
+        }
+        close(fds[1]);
+        run_result child = {0};
+        if(read(fds[0], &child, sizeof(child)) != sizeof(child)){
+            child.ok = FALSE;
+        }
+        close(fds[0]);
+        waitpid(pid, NULL, 0);
+        if(timed){
+            result -> peakHeap = child.peakHeap;
+            memcpy(result -> latency, child.latency, sizeof(child.latency));
+            result -> ok = result -> ok && child.ok;
+        }else{
+            *result = child;
+        }
+    }
+}
+
+static void report(trace *t, allocator *a, run_result *r){
+    if(!r -> ok){
+        printf("%-6s failed at operation %zu\n", a -> name, r -> failedOp);
+        return;
+    }
+    double opsPerSec = r -> seconds > 0 ? t -> numOps / r -> seconds : 0;
+    double utilization = r -> peakHeap > 0 ? 100.0 * t -> peakLive / r -> peakHeap : 0;
+    printf("%-6s %12.0f %10zu %6.1f%% %8lu %8lu %8lu %8lu %8lu %8lu\n", a -> name, opsPerSec, r -> peakHeap,
+        utilization, (unsigned long) r -> latency[5], (unsigned long) r -> latency[0], (unsigned long) r -> latency[1],
+        (unsigned long) r -> latency[2], (unsigned long) r -> latency[3], (unsigned long) r -> latency[4]);
+}
+
+//xorshift64, so generated traces are the same on every platform
+static uint64_t nextRandom(uint64_t *state){
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static size_t randomBetween(uint64_t *state, size_t low, size_t high){
+    return low + nextRandom(state) % (high - low + 1);
+}
+
+/*
+ * Write a synthetic trace to stdout.  Each kind but large keeps its peak live bytes well
+ * inside the sfutil heap so that the traces also run against the stock sf_mem_grow.
+ *   churn: many small objects (8-64 bytes) allocated and freed in random order.
+ *   grow:  a few buffers grown by appending with realloc, then dropped, plus small noise.
+ *   mixed: mostly small, some medium and a few large objects.
+ *   large: blocks of 8-64KB, under the mmap threshold, with small objects pinned between them.
+ */
+static int generateTrace(const char *kind, size_t numOps, uint64_t seed){
+    #define MAX_LIVE 512
+    size_t sizes[MAX_LIVE] = {0};
+    int live[MAX_LIVE] = {0};
+    size_t liveBytes = 0;
+    uint64_t state = seed != 0 ? seed : 1;
+
+    printf("# synthetic %s trace, %zu operations, seed %lu\n", kind, numOps, (unsigned long) seed);
+    if(strcmp(kind, "churn") == 0){
+        for(size_t i = 0; i < numOps; i++){
+            size_t id = randomBetween(&state, 0, MAX_LIVE - 1);
+            if(live[id]){
+                printf("f %zu\n", id);
+                live[id] = FALSE;
+            }else{
+                printf("a %zu %zu\n", id, randomBetween(&state, 8, 64));
+                live[id] = TRUE;
+            }
+        }
+    }else if(strcmp(kind, "grow") == 0){
+        #define NUM_BUFFERS 3
+        for(size_t i = 0; i < numOps; i++){
+            if(nextRandom(&state) % 4 == 0){//small noise allocations use ids after the buffers
+                size_t id = NUM_BUFFERS + randomBetween(&state, 0, 63);
+                if(live[id]){
+                    printf("f %zu\n", id);
+                }else{
+                    printf("a %zu %zu\n", id, randomBetween(&state, 16, 48));
+                }
+                live[id] = !live[id];
+                continue;
+            }
+            size_t id = randomBetween(&state, 0, NUM_BUFFERS - 1);
+            if(!live[id]){
+                sizes[id] = 16;
+                printf("a %zu %zu\n", id, sizes[id]);
+                live[id] = TRUE;
+            }else if(sizes[id] >= 6144){
+                printf("f %zu\n", id);
+                live[id] = FALSE;
+            }else{
+                sizes[id] += randomBetween(&state, 16, 128);
+                printf("r %zu %zu\n", id, sizes[id]);
+            }
+        }
+    }else if(strcmp(kind, "mixed") == 0){
+        for(size_t i = 0; i < numOps; i++){
+            size_t id = randomBetween(&state, 0, 255);
+            if(live[id]){
+                printf("f %zu\n", id);
+                liveBytes -= sizes[id];
+                live[id] = FALSE;
+                continue;
+            }
+            uint64_t roll = nextRandom(&state) % 100;
+            size_t size = roll < 70 ? randomBetween(&state, 8, 128)
+                : roll < 95 ? randomBetween(&state, 129, 1024) : randomBetween(&state, 1025, 4096);
+            if(liveBytes + size > 24576){//keep the live set small enough for the sfutil heap
+                continue;
+            }
+            printf("a %zu %zu\n", id, size);
+            sizes[id] = size;
+            liveBytes += size;
+            live[id] = TRUE;
+        }
+    }else if(strcmp(kind, "large") == 0){
+        for(size_t i = 0; i < numOps; i++){
+            size_t id = randomBetween(&state, 0, 127);
+            if(live[id]){
+                printf("f %zu\n", id);
+                liveBytes -= sizes[id];
+                live[id] = FALSE;
+                continue;
+            }
+            size_t size = nextRandom(&state) % 4 == 0 ? randomBetween(&state, 16, 256) : randomBetween(&state, 8192, 65536);
+            if(liveBytes + size > 1536 * 1024){
+                continue;
+            }
+            printf("a %zu %zu\n", id, size);
+            sizes[id] = size;
+            liveBytes += size;
+            live[id] = TRUE;
+        }
+    }else{
+        fprintf(stderr, "unknown trace kind %s\n", kind);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void usage(const char *name){
+    fprintf(stderr, "usage: %s [-a sfmm|libc] [-H ops] trace...\n", name);
+    fprintf(stderr, "       %s -g churn|grow|mixed|large [-n ops] [-s seed]\n", name);
+}
+
+int main(int argc, char *argv[]){
+    const char *only = NULL;
+    const char *kind = NULL;
+    size_t numOps = 20000;
+    uint64_t seed = 1;
+    int opt;
+    while((opt = getopt(argc, argv, "a:g:H:n:s:")) != -1){
+        switch(opt){
+            case 'a':
+                only = optarg;
+                break;
+            case 'g':
+                kind = optarg;
+                break;
+            case 'H':
+                shapeInterval = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                numOps = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(kind != NULL){
+        return generateTrace(kind, numOps, seed) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if(optind == argc){
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    sf_set_provider(&sf_mmap_provider); //no ceiling on the heap, as in production
+    int status = EXIT_SUCCESS;
+    for(int i = optind; i < argc; i++){
+        trace t;
+        if(!loadTrace(argv[i], &t)){
+            status = EXIT_FAILURE;
+            continue;
+        }
+        printf("%s: %zu ops, peak live %zu bytes\n", t.path, t.numOps, t.peakLive);
+        printf("%-6s %12s %10s %7s %8s %8s %8s %8s %8s %8s\n", "alloc", "ops/sec", "peak heap", "util",
+            "mean ns", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+        for(size_t j = 0; j < NUM_ALLOCATORS; j++){
+            if(only != NULL && strcmp(only, allocators[j].name) != 0){
+                continue;
+            }
+            run_result result = {0};
+            measure(&t, &allocators[j], &result);
+            report(&t, &allocators[j], &result);
+            if(!result.ok){
+                status = EXIT_FAILURE;
+            }
+        }
+        printf("\n");
+        unmapArray(t.ops, t.capacity, sizeof(trace_op));
+    }
+    return status;
+}
@@ -1,7 +1,201 @@
 #ifndef SFMM_UTIL_H
 #define SFMM_UTIL_H
 
+#include <stdio.h>
+
 size_t maskInfoBits(size_t size);
 int validatePointer(void *pp);
 
+/*
+ * Number of times each sf_realloc path has been taken.
+ */
+typedef struct {
+    size_t fitted;        // The new size fit in the existing block with too little to spare to give back, so it was kept as is.
+    size_t shrunk;        // The block was cut down to the new size, its tail freed.
+    size_t grownIntoNext; // Grown in place by absorbing the free block that follows it.
+    size_t grownHeap;     // Grown in place by extending the heap past the last block.
+    size_t moved;         // Fell back to sf_malloc, memcpy and sf_free.
+} sf_realloc_counters;
+
+sf_realloc_counters sf_realloc_stats();
+
+/*
+ * Allocator statistics, kept up to date as the heap changes.  Blocks sitting in a
+ * thread cache (SF_THREADS) count as in use.  Byte counts include block headers.
+ */
+typedef struct {
+    size_t heapSize;                         // Bytes of memory the heap has grown to.
+    size_t peakHeapSize;                     // Largest heapSize seen so far.
+    size_t bytesInUse;                       // Bytes in blocks allocated to the caller, mapped ones included.
+    size_t freeBytes[NUM_FREE_LISTS];        // Bytes in the blocks of each free list.
+    size_t quickListBytes[NUM_QUICK_LISTS];  // Bytes in the blocks of each quick list.
+    size_t quickListHits[NUM_QUICK_LISTS];   // Allocations each quick list served.
+    size_t quickListMisses[NUM_QUICK_LISTS]; // Allocations of each quick list's size that found it empty.
+    size_t quickListFlushes[NUM_QUICK_LISTS]; // Times each quick list moved its oldest blocks to the free lists.
+    int quickListCapacity[NUM_QUICK_LISTS];  // Blocks each quick list currently holds before flushing, 0 before the first allocation.
+    size_t dirtyBytes;                       // Bytes of whole pages inside free blocks or empty slab runs that still hold memory.
+    size_t purgedBytes;                      // Bytes of such pages given back to the provider.
+    size_t callocSkippedBytes;               // Bytes sf_calloc did not clear because they were known to be zero.
+    size_t splinterAllocs;                   // Allocations so far handed a block with a leftover too small to split off.
+    size_t splinterAllocBytes;               // Bytes of their leftovers, a running total that frees do not lower. Slack left by a sf_realloc shrinking a block in place is not counted.
+    size_t slabBytes;                        // Bytes of heap blocks holding slab runs, part of bytesInUse.
+    size_t slabUsedBytes;                    // Bytes of slab slots allocated to the caller.
+    size_t mappedBytes;                      // Bytes mapped for blocks at or above the mmap threshold.
+    size_t mappedBlocks;                     // Number of such blocks.
+    size_t mallocCalls;                      // Blocks requested through malloc, calloc and malloc_batch.
+    size_t freeCalls;                        // Blocks released through free, free_sized and free_batch.
+    size_t reallocCalls;
+    size_t memalignCalls;
+    size_t mallocFailures;                   // Requests that returned NULL with sf_errno set.
+    size_t reallocFailures;
+    size_t memalignFailures;
+    sf_realloc_counters realloc;             // Same as sf_realloc_stats().
+} sf_heap_stats;
+
+sf_heap_stats sf_stats();
+
+size_t sf_malloc_batch(size_t size, size_t n, void **out);
+void sf_free_batch(void **ptrs, size_t n);
+void sf_free_sized(void *ptr, size_t size);
+int sf_posix_memalign(void **memptr, size_t align, size_t size);
+void *sf_aligned_alloc(size_t align, size_t size);
+void *sf_calloc(size_t nmemb, size_t size);
+size_t sf_malloc_usable_size(void *ptr);
+size_t sf_set_mmap_threshold(size_t size);
+size_t sf_set_slab_max(size_t size);
+
+/*
+ * The shape of a heap, found by walking it block by block from the prologue to the epilogue.
+ * Mapped blocks are not part of the heap.  Slab runs (SF_SLABS) are allocated blocks.  Byte
+ * counts include block headers.
+ */
+#define SF_BLOCK_ALLOCATED 0
+#define SF_BLOCK_FREE 1
+#define SF_BLOCK_QUICK 2  // Freed into a quick list or a thread cache (SF_THREADS), it does not coalesce yet.
+#define SF_HEAP_SIZE_BUCKETS 32
+
+typedef void (*sf_heap_visitor)(void *payload, size_t size, int state, void *arg);
+
+typedef struct {
+    size_t heapSize;                              // Same as sf_heap_stats.
+    size_t allocatedBlocks;
+    size_t allocatedBytes;
+    size_t freeBlocks;                            // Blocks on the free lists.
+    size_t freeBytes;
+    size_t largestFreeBlock;                      // Largest request the heap can serve without growing is this less a header.
+    size_t quickListBlocks;
+    size_t quickListBytes;                        // Free bytes that cannot merge with their neighbours.
+    size_t freeRuns;                              // Runs of adjacent free and quick list blocks between allocated ones.
+    size_t largestFreeRun;                        // Bytes in the largest run, the largest block sf_consolidate can make.
+    size_t freeBlocksBySize[SF_HEAP_SIZE_BUCKETS]; // Free blocks whose size is i bits long, the last bucket also holds longer ones.
+} sf_heap_shape;
+
+void sf_heap_walk(sf_heap_visitor visit, void *arg);
+sf_heap_shape sf_shape();
+void sf_shape_dump(const sf_heap_shape *shape, FILE *out);
+
+/*
+ * Where an arena's memory comes from.  The arena reserves one range of address space up
+ * front, commits pages at the end of its heap as the heap grows, decommits pages whose
+ * contents it no longer needs and releases the range when it is destroyed.  Freshly
+ * committed and decommitted pages must read as zero, sf_calloc does not clear them.
+ */
+typedef struct {
+    void *(*reserve)(size_t size);              // Reserve size bytes, NULL if there is no room.
+    size_t (*commit)(void *addr, size_t size);  // Make pages usable, returns how many bytes from addr were.
+    void (*decommit)(void *addr, size_t size);  // Let the memory go, pages stay usable and must read back as zeros.
+    void (*release)(void *addr, size_t size);   // Give back a whole reservation.
+} sf_provider;
+
+extern const sf_provider sf_mmap_provider;     // Anonymous mmap, commits with mprotect.
+extern const sf_provider sf_sfutil_provider;   // The fixed region behind sf_mem_grow.
+
+int sf_set_provider(const sf_provider *provider);
+
+#define SF_GROWTH_EXACT 0      // Grow the heap by just enough pages for the request.
+#define SF_GROWTH_GEOMETRIC 1  // Grow the heap by at least its current size.
+int sf_set_heap_growth(int policy);
+void sf_set_purge(size_t threshold, unsigned long decay);
+size_t sf_trim();
+size_t sf_consolidate();
+
+/*
+ * An independent heap with its own free lists, quick lists, prologue, epilogue and
+ * memory region.  See sfmm.c for the arena functions.
+ */
+typedef struct sf_arena sf_arena;
+
+sf_arena *sf_arena_create(size_t size);
+void sf_arena_destroy(sf_arena *arena);
+void *sf_arena_malloc(sf_arena *arena, size_t size);
+void sf_arena_free(sf_arena *arena, void *ptr);
+void *sf_arena_realloc(sf_arena *arena, void *ptr, size_t size);
+sf_heap_stats sf_arena_stats(sf_arena *arena);
+size_t sf_arena_trim(sf_arena *arena);
+size_t sf_arena_consolidate(sf_arena *arena);
+void sf_arena_heap_walk(sf_arena *arena, sf_heap_visitor visit, void *arg);
+sf_heap_shape sf_arena_shape(sf_arena *arena);
+
+/*
+ * Binary trace written when sfmm is built with -DSF_TRACE and the SF_TRACE_FILE environment
+ * variable names a file.  The file holds an sf_trace_header followed by one sf_trace_record per
+ * call, in call order, in the byte order of the machine that wrote it.  bin/sfmm_bench replays it.
+ */
+#define SF_TRACE_MAGIC 0x3145434152544653 // "SFTRACE1" when read as little endian bytes
+#define SF_TRACE_MALLOC 1
+#define SF_TRACE_FREE 2
+#define SF_TRACE_REALLOC 3
+#define SF_TRACE_MEMALIGN 4
+
+typedef struct {
+    uint64_t magic;       // SF_TRACE_MAGIC.
+    uint32_t recordSize;  // sizeof(sf_trace_record) of the writer.
+    uint32_t reserved;
+} sf_trace_header;
+
+typedef struct {
+    uint64_t timestamp;   // Nanoseconds since the trace was opened.
+    uint64_t ptr;         // Pointer passed in by free and realloc, 0 otherwise.
+    uint64_t result;      // Pointer returned by malloc, realloc and memalign, 0 on failure.
+    uint64_t size;        // Requested size, 0 for free.
+    uint32_t align;       // Requested alignment for memalign, 0 otherwise.
+    uint32_t op;          // One of SF_TRACE_MALLOC, SF_TRACE_FREE, SF_TRACE_REALLOC, SF_TRACE_MEMALIGN.
+} sf_trace_record;
+
+void sf_trace_flush();
+
+/*
+ * Latency histograms and counters kept when sfmm is built with -DSF_PROFILE (make profile),
+ * for the whole process across arenas.  Times are in ticks of the cycle counter on x86 and in
+ * nanoseconds elsewhere.  Phases are timed inside the calls that run them and may nest in one
+ * another, extendHeap coalescing its new pages for one.  If the SF_PROFILE_FILE environment
+ * variable names a file, sf_profile_dump writes a report to it at exit.
+ */
+#define SF_PROFILE_BUCKETS 40
+
+typedef struct {
+    uint64_t count;                        // Events recorded.
+    uint64_t total;                        // Sum of their values.
+    uint64_t buckets[SF_PROFILE_BUCKETS];  // Events whose value is i bits long, the last bucket also holds longer ones.
+} sf_histogram;
+
+typedef struct {
+    sf_histogram mallocLatency;            // sf_malloc.
+    sf_histogram callocLatency;            // sf_calloc.
+    sf_histogram freeLatency;              // sf_free and sf_free_sized.
+    sf_histogram reallocLatency;           // sf_realloc.
+    sf_histogram memalignLatency;          // sf_memalign, which posix_memalign and aligned_alloc go through.
+    sf_histogram quickListHit;             // Taking a block off a quick list.
+    sf_histogram freeListSearch;           // Finding and unlinking a free block big enough for a request.
+    sf_histogram coalesce;                 // Putting a free block on the free lists, merged with its neighbours.
+    sf_histogram extendHeap;               // Growing a heap.
+    sf_histogram consolidate;              // Emptying the quick lists into the free lists.
+    sf_histogram nodesVisited;             // Free blocks looked at per free list search, tree nodes included.
+    uint64_t coalesceCases[4];             // Insertions whose neighbours were both free, prev free, next free, neither.
+} sf_profile;
+
+sf_profile sf_profile_stats();
+void sf_profile_reset();
+void sf_profile_dump(FILE *out);
+
 #endif
\ No newline at end of file
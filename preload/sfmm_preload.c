@@ -0,0 +1,82 @@
+/*
+ * The standard malloc family on top of sfmm, built as bin/libsfmm.so by make preload so that
+ * any program can run on sfmm with LD_PRELOAD=bin/libsfmm.so.
+ *
+ * The library is built thread-safe on the mmap heap and needs no set up before its first call:
+ * the main arena and its lock are initialized statically, sf_malloc reserves the heap on its
+ * first call, and nothing on that path allocates.  Nothing is looked up with dlsym either, so
+ * there is no call into the C library's malloc to bootstrap around.  Pointers that sfmm did
+ * not hand out abort when freed, as they do with sf_free.
+ *
+ * Built with SF_PRELOAD, sfmm aligns every payload to 16 bytes like the C library does, sets
+ * errno itself where a call fails and holds its lock across fork.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include "sfmm.h"
+#include "sfmm_util.h"
+
+//The sf_ functions return NULL for 0 bytes, but callers of malloc expect a pointer they can free
+static size_t atLeastOne(size_t size){
+    return size == 0 ? 1 : size;
+}
+
+void *malloc(size_t size){
+    return sf_malloc(atLeastOne(size));
+}
+
+void free(void *ptr){
+    if(ptr != NULL){
+        sf_free(ptr);
+    }
+}
+
+void *realloc(void *ptr, size_t size){
+    if(ptr == NULL){
+        return malloc(size);
+    }
+    if(size == 0){//frees like glibc does
+        sf_free(ptr);
+        return NULL;
+    }
+    return sf_realloc(ptr, size);
+}
+
+void *calloc(size_t nmemb, size_t size){
+    if(nmemb == 0 || size == 0){
+        nmemb = size = 1;
+    }
+    return sf_calloc(nmemb, size);
+}
+
+void *memalign(size_t align, size_t size){
+    return sf_aligned_alloc(align, atLeastOne(size));
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size){
+    int savedErrno = errno; //posix_memalign reports failures only in its result
+    int result = sf_posix_memalign(memptr, align, atLeastOne(size));
+    errno = savedErrno;
+    return result;
+}
+
+void *aligned_alloc(size_t align, size_t size){
+    return sf_aligned_alloc(align, atLeastOne(size));
+}
+
+void *valloc(size_t size){
+    return sf_memalign(atLeastOne(size), PAGE_SZ);
+}
+
+void *pvalloc(size_t size){
+    size = (atLeastOne(size) + PAGE_SZ - 1) & ~(size_t) (PAGE_SZ - 1);
+    if(size == 0){//rounding up overflowed
+        errno = ENOMEM;
+        return NULL;
+    }
+    return sf_memalign(size, PAGE_SZ);
+}
+
+size_t malloc_usable_size(void *ptr){
+    return sf_malloc_usable_size(ptr);
+}
@@ -0,0 +1,62 @@
+/*
+ * Backing-memory providers.  An arena reserves one contiguous range of address space
+ * from its provider up front, commits pages at the end of its heap as the heap grows,
+ * may decommit pages whose contents it no longer needs and releases the range when it
+ * is destroyed.  Decommitted pages stay usable but lose their contents, reading as zero
+ * like freshly committed ones.
+ */
+#define _DEFAULT_SOURCE //for MAP_ANONYMOUS and MAP_NORESERVE
+#include <string.h>
+#include <sys/mman.h>
+#include "sfmm.h"
+#include "sfmm_util.h"
+
+//Reserve address space without memory behind it, pages become usable when committed
+static void *mmapReserve(size_t size){
+    void *addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+static size_t mmapCommit(void *addr, size_t size){
+    return mprotect(addr, size, PROT_READ | PROT_WRITE) == 0 ? size : 0;
+}
+
+//Drop the pages' contents so the system can reuse the memory until they are touched again
+static void mmapDecommit(void *addr, size_t size){
+    madvise(addr, size, MADV_DONTNEED);
+}
+
+static void mmapRelease(void *addr, size_t size){
+    munmap(addr, size);
+}
+
+const sf_provider sf_mmap_provider = {mmapReserve, mmapCommit, mmapDecommit, mmapRelease};
+
+#ifndef SF_PRELOAD //libsfmm.so is built without sfutil
+
+//sfutil has one fixed region that only grows, so the reservation is wherever that region currently ends
+static void *sfutilReserve(size_t size){
+    return sf_mem_end();
+}
+
+//sf_mem_grow hands out the next page of the region, stop at the first page it refuses. The region comes from
+//malloc and is not cleared, so the pages are cleared here to read as zero like freshly mapped ones
+static size_t sfutilCommit(void *addr, size_t size){
+    size_t committed = 0;
+    while(committed < size && sf_mem_end() == (char *) addr + committed && sf_mem_grow() != NULL){
+        committed += PAGE_SZ;
+    }
+    memset(addr, 0, committed);
+    return committed;
+}
+
+//The region cannot give memory back, decommitted pages are only cleared
+static void sfutilDecommit(void *addr, size_t size){
+    memset(addr, 0, size);
+}
+
+static void sfutilRelease(void *addr, size_t size){
+}
+
+const sf_provider sf_sfutil_provider = {sfutilReserve, sfutilCommit, sfutilDecommit, sfutilRelease};
+#endif
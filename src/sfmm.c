@@ -2,6 +2,7 @@
  * Do not submit your assignment with a main function in this file.
  * If you submit with a main function in this file, you will get a zero.
  */
+#define _GNU_SOURCE //for MAP_ANONYMOUS and mremap
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,17 +11,327 @@
 #include "sfmm_util.h"
 #include <errno.h>
 #include <inttypes.h>
+#include <sys/mman.h>
+#include <time.h>
+#ifdef SF_THREADS
+#include <pthread.h>
+#endif
+#ifdef SF_TRACE
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define TRUE (1)
 #define FALSE (0)
 #define WORD_SIZE 2 //word size = 2 bytes
 #define MEM_ROW_SIZE 8 //memory row size = 8 bytes
 #define HEADER_SIZE 8 //header size = 8 bytes
+
+//The size classes can be tuned at build time, e.g. -DMIN_BLOCK_SIZE=48. Free list i holds blocks of up to
+//MIN_BLOCK_SIZE * 2^i bytes and quick list i blocks of exactly MIN_BLOCK_SIZE + 8i bytes. How many lists
+//there are is fixed by sfmm.h, whose arrays sfutil was built with.
+#ifndef MIN_BLOCK_SIZE
 #define MIN_BLOCK_SIZE 32 //min block size = 32 bytes
+#endif
+#if MIN_BLOCK_SIZE < 32 || MIN_BLOCK_SIZE % 8 != 0
+#error "MIN_BLOCK_SIZE must be a multiple of 8 of at least 32, room for a header, two links and a footer"
+#endif
+
+//Every payload is aligned to BLOCK_ALIGN bytes. Block sizes are multiples of it and the prologue is moved up
+//by BLOCK_ALIGN - 8 bytes so that block starts stay 8 bytes short of it. libsfmm.so is built with 16, the
+//alignment the C library's malloc guarantees for any type.
+#ifndef BLOCK_ALIGN
+#ifdef SF_PRELOAD
+#define BLOCK_ALIGN 16
+#else
+#define BLOCK_ALIGN 8
+#endif
+#endif
+#if (BLOCK_ALIGN != 8 && BLOCK_ALIGN != 16) || MIN_BLOCK_SIZE % BLOCK_ALIGN != 0
+#error "BLOCK_ALIGN must be 8 or 16 and divide MIN_BLOCK_SIZE"
+#endif
+#define PROLOGUE_OFFSET (BLOCK_ALIGN - sizeof(sf_header))
+
+//Built with SF_TLSF, free blocks are placed by two-level segregated fit instead of the size classes of sfmm.h.
+//The first level splits sizes at powers of two and the second splits each power of two into TLSF_SL_COUNT
+//equal ranges, with a bitmap per level so the first non-empty list that can hold a request is found with two
+//bit scans. Blocks under TLSF_SMALL_SIZE share the first first-level class, 8 bytes per list, and blocks too
+//big for the last class are all kept in its last list. The main arena's lists live in tlsfListHeads.
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_SMALL_SIZE (TLSF_SL_COUNT * 8)
+#define TLSF_FL_SHIFT 7 //log2 of TLSF_SMALL_SIZE
+#define TLSF_FL_COUNT 32 //one bit each in the first-level bitmap
+#ifdef SF_TLSF
+#define FREE_LIST_COUNT (TLSF_FL_COUNT * TLSF_SL_COUNT)
+#else
+#define FREE_LIST_COUNT NUM_FREE_LISTS
+#endif
+
+//Bytes of a free block known to read as zero, which sf_calloc does not have to clear. Empty when start == end
+typedef struct {
+    char *start;
+    char *end;
+} zero_range;
+
+/*
+ * All of the state for one heap lives in an arena.  The main arena backs sf_malloc and friends and
+ * uses the sf_free_list_heads/sf_quick_lists globals; arenas made by sf_arena_create carry their own
+ * lists.  Every arena reserves a range of address space from its provider and commits pages at the end
+ * of its heap as the heap grows.  The main arena reserves on its first allocation from the provider set
+ * with sf_set_provider (sfutil unless built with SF_MMAP_HEAP); private arenas reserve from the mmap
+ * provider when created and keep the arena struct at the start of their range.
+ */
+struct sf_arena {
+    int mallocInit; //Indicates whether a first malloc call has been made to initalize 
+    sf_block *heapProPtr; //this will be a pointer to the prologue block 
+    sf_block *heapEpiPtr; //this will be a pointer to the epilogue block 
+    unsigned int freeListBitmap; //bit i is set when freeListHeads[i] holds at least one block, or under
+                                 //SF_TLSF when first-level class i does
+#ifdef SF_TLSF
+    unsigned int slBitmap[TLSF_FL_COUNT]; //bit j of word i is set when list j of first-level class i is non-empty
+#endif
+    sf_block *freeListHeads; //dummy heads of this arena's free lists
+    sf_block *largeTree; //root of the tree over the last free list, see treeInsert
+    __typeof__(sf_quick_lists[0]) *quickLists; //this arena's quick lists
+    int quickCapacity[NUM_QUICK_LISTS]; //blocks each quick list holds before it is flushed
+    int quickMisses[NUM_QUICK_LISTS]; //misses of each quick list since it was last flushed, -1 before its first flush
+    sf_heap_stats stats; //counters behind sf_stats, bytesInUse is derived when a snapshot is taken
+    const sf_provider *provider; //where the arena's memory comes from
+    void *memStart; //start of the range reserved from the provider, NULL until reserved
+    void *memEnd; //end of the heap
+    void *committedEnd; //end of the pages committed so far, at or past memEnd
+    void *memLimit; //end of the reserved range
+    size_t regionSize; //length of the reserved range
+    uint64_t dirtySince; //millisecond clock when stats.dirtyBytes went past purgeThreshold, 0 while below it
+    zero_range takenZero; //known-zero bytes of the block removeBlockFromFreeList last took out
+#ifdef SF_THREADS
+    pthread_mutex_t lock;
+#endif
+    sf_block ownFreeListHeads[FREE_LIST_COUNT];
+    __typeof__(sf_quick_lists[0]) ownQuickLists[NUM_QUICK_LISTS];
+};
+
+#if defined(SF_MMAP_HEAP) || defined(SF_PRELOAD) //libsfmm.so has no sfutil to fall back on
+#define DEFAULT_PROVIDER (&sf_mmap_provider)
+#else
+#define DEFAULT_PROVIDER (&sf_sfutil_provider)
+#endif
+
+#ifdef SF_TLSF
+static sf_block tlsfListHeads[FREE_LIST_COUNT];
+#define MAIN_FREE_LIST_HEADS tlsfListHeads
+#else
+#define MAIN_FREE_LIST_HEADS sf_free_list_heads
+#endif
+
+static sf_arena mainArena = {
+    .freeListHeads = MAIN_FREE_LIST_HEADS,
+    .quickLists = sf_quick_lists,
+    .provider = DEFAULT_PROVIDER,
+#ifdef SF_THREADS
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+#define DEFAULT_ARENA_SIZE ((size_t)64 << 20) //max bytes of a private arena region when none is given
+#define MAIN_HEAP_RESERVE ((size_t)1 << 32) //address space the main arena reserves, the most its heap can grow to
+
+//Requests of at least mmapThreshold bytes to sf_malloc and sf_realloc get a mapping of their own instead
+//of a heap block. Such a block starts one row into a fresh mapping, after the length of the mapping.
+#define DEFAULT_MMAP_THRESHOLD ((size_t)128 << 10)
+//Blocks from sf_memalign with an alignment above 16 start a page into their mapping instead, with the length
+//and header at the end of the first page, so that the payload is page aligned.
+#define MAPPED_PAYLOAD_OFFSET (2 * sizeof(sf_header))
+#define MAPPED_BLOCK 0x4 //header bits of a mapped block: in quick list without allocated, which no heap block has
+#define MAPPED_BLOCK_MASK 0x5
+static size_t mmapThreshold = DEFAULT_MMAP_THRESHOLD;
+
+//Quick lists start out holding QUICK_LIST_CAP_MIN blocks. A full list flushes its oldest blocks to the free
+//lists and keeps the newest half. If its size missed since the previous flush the flushed blocks were wanted
+//after all, so the capacity doubles (up to QUICK_LIST_CAP_MAX) and nothing is flushed; if it never missed, the
+//capacity halves back toward QUICK_LIST_CAP_MIN. Both can be set at build time.
+#ifndef QUICK_LIST_CAP_MIN
+#define QUICK_LIST_CAP_MIN QUICK_LIST_MAX
+#endif
+#ifndef QUICK_LIST_CAP_MAX
+#define QUICK_LIST_CAP_MAX 32
+#endif
+#if QUICK_LIST_CAP_MIN < 1 || QUICK_LIST_CAP_MAX < QUICK_LIST_CAP_MIN
+#error "quick list capacities must satisfy 1 <= QUICK_LIST_CAP_MIN <= QUICK_LIST_CAP_MAX"
+#endif
+
+#define MAX_GEOMETRIC_GROWTH ((size_t)1 << 20) //largest single step of geometric heap growth
+static int heapGrowth = SF_GROWTH_EXACT; //policy used by extendHeap, see sf_set_heap_growth
+
+//Whole pages inside large free blocks are dirty until purged, which decommits them and writes a mark into
+//the word before the block's footer. Once an arena has more than purgeThreshold dirty bytes for purgeDecay
+//milliseconds, the next free purges them all and trims the free block at the end of the heap.
+#define DEFAULT_PURGE_THRESHOLD ((size_t)1 << 20)
+#define DEFAULT_PURGE_DECAY 1000
+#define PURGE_MARK ((uintptr_t)0x5046a5ed5046a5ed) //xor'd with a purged block's address to form its mark
+//A free block of at least ZERO_MARK_MIN_SIZE bytes whose bytes past its tree node and before its mark have
+//never been written since the pages were committed, or were cleared when it merged, carries a zero mark in
+//the same word instead. Purged pages read as zero too, see sf_provider.
+#define ZERO_MARK ((uintptr_t)0x2e60b10c2e60b10c) //xor'd with a zeroed block's address to form its mark
+#define ZERO_MARK_MIN_SIZE 64
+static size_t purgeThreshold = DEFAULT_PURGE_THRESHOLD;
+static uint64_t purgeDecay = DEFAULT_PURGE_DECAY;
+
+//Requests to sf_malloc of at most slabMax bytes are served from slabs: chunks of whole pages carved out of
+//the main heap, each page a run of equal slots with an allocation bitmap and no header per slot. A slot's
+//run is found by rounding its address down to a page, and a pointer is a slot if it lies in a chunk.
+//Slabs are on by default when built with SF_SLABS. Slab state is guarded by the main arena's lock.
+#define SLAB_MAX_SIZE 24 //largest slot size, slots come in multiples of 8 bytes up to it
+#define SLAB_LIMIT (SLAB_MAX_SIZE & ~(BLOCK_ALIGN - 1)) //largest slot size that is a multiple of BLOCK_ALIGN
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE / 8)
+#define SLAB_BITMAP_WORDS (PAGE_SZ / 8 / 64) //enough bits for the smallest slots
+#define MIN_SLAB_CHUNK_PAGES 4 //size of the first chunk, later chunks double up to the max
+#define MAX_SLAB_CHUNK_PAGES 1024
+#define MAX_SLAB_CHUNKS 32
+#ifdef SF_SLABS
+#define DEFAULT_SLAB_MAX SLAB_LIMIT
+#else
+#define DEFAULT_SLAB_MAX 0
+#endif
 
-static int mallocInit = FALSE; //Indicates whether a first malloc call has been made to initalize 
-static sf_block *heapProPtr = NULL; //this will be a pointer to the prologue block 
-static sf_block *heapEpiPtr = NULL; //this will be a pointer to the epilogue block 
+typedef struct slab_run {
+    struct slab_run *next; //runs of the same class with free slots, or empty runs
+    struct slab_run *prev;
+    size_t slotSize; //0 while the run is empty
+    size_t used; //slots allocated
+    size_t numSlots;
+    uint64_t bitmap[SLAB_BITMAP_WORDS]; //bit set for each allocated slot, and for bits past numSlots
+    char slots[] __attribute__((aligned(16))); //slots of 16 bytes are 16 byte aligned like malloc's
+} slab_run;
+
+static size_t slabMax = DEFAULT_SLAB_MAX;
+static slab_run *slabRuns[NUM_SLAB_CLASSES]; //runs with free slots, by class
+static slab_run *emptySlabRuns;
+static char *slabChunkEnd; //next page of the newest chunk that has never been a run
+static char *slabChunkLimit;
+static struct {
+    char *start;
+    char *end;
+} slabChunks[MAX_SLAB_CHUNKS];
+static int numSlabChunks;
+//Empty runs whose pages were given back to the provider by purgeSlabRuns. A purged page reads as zero, run
+//header included, so it is remembered by a bit here instead of on emptySlabRuns
+static uint64_t purgedSlabPages[MAX_SLAB_CHUNKS][MAX_SLAB_CHUNK_PAGES / 64];
+static size_t numPurgedSlabPages;
+static size_t purgeSlabRuns();
+
+#ifdef SF_THREADS
+//In the thread-safe build every access to an arena happens with its lock held.
+//Small blocks of the main arena are first served from a per-thread cache that only takes the lock to
+//refill or drain.
+#define THREAD_CACHE_MAX 16   //max blocks of one size held by a thread cache
+#define THREAD_CACHE_BATCH 8  //blocks moved between a thread cache and the heap per lock acquisition
+static pthread_once_t threadCacheKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t threadCacheKey; //only used to drain a thread's cache when the thread exits
+static __thread int threadCacheRegistered = FALSE;
+static __thread int threadCacheReleased = FALSE; //set once the thread is exiting, its later calls skip the cache
+static __thread struct {
+    int length;             // Number of blocks currently in the cache.
+    struct sf_block *first; // Pointer to first block in the cache.
+} threadCache[NUM_QUICK_LISTS];
+#define LOCK_ARENA(arena) pthread_mutex_lock(&(arena) -> lock)
+#define UNLOCK_ARENA(arena) pthread_mutex_unlock(&(arena) -> lock)
+//Call counters are bumped outside the arena lock on the thread cache paths, mapped block counters always are
+#define COUNT_CALLS(arena, field, n) __atomic_fetch_add(&(arena) -> stats.field, (n), __ATOMIC_RELAXED)
+#else
+#define LOCK_ARENA(arena)
+#define UNLOCK_ARENA(arena)
+#define COUNT_CALLS(arena, field, n) ((arena) -> stats.field += (n))
+#endif
+
+#ifdef SF_TRACE
+//Calls through the public API are appended to a buffer of trace records that is written out to
+//$SF_TRACE_FILE whenever it fills, on sf_trace_flush and at exit.  Without SF_TRACE_FILE nothing is recorded.
+#define TRACE_BUFFER_RECORDS 4096 //records buffered between writes, 160KB
+static int traceState = 0; //0 until SF_TRACE_FILE has been looked at, then 1 if recording and -1 if not
+static int traceFd = -1;
+static uint64_t traceStart; //timestamps are relative to this
+static size_t traceLength; //records currently buffered
+static sf_trace_record traceBuffer[TRACE_BUFFER_RECORDS];
+#ifdef SF_THREADS
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_TRACE() pthread_mutex_lock(&traceLock)
+#define UNLOCK_TRACE() pthread_mutex_unlock(&traceLock)
+#else
+#define LOCK_TRACE()
+#define UNLOCK_TRACE()
+#endif
+#define TRACE(op, ptr, result, size, align) traceRecord((op), (ptr), (result), (size), (align))
+#else
+#define TRACE(op, ptr, result, size, align)
+#endif
+
+#ifdef SF_PROFILE
+//Public calls and the internal phases they run are timed into the histograms of profile, see sf_profile.
+//A function takes the time with PROFILE_START and records it with PROFILE_END before each return. Updates are
+//atomic because thread cache paths and separate arenas run without a common lock
+static sf_profile profile;
+static int profileState = 0; //0 until SF_PROFILE_FILE has been looked at
+static __thread uint64_t profileVisited; //free blocks looked at by this thread's current free list search
+#define PROFILE_START() uint64_t profileStart = profileClock()
+#define PROFILE_END(field) profileRecord(&profile.field, profileClock() - profileStart)
+#define PROFILE_COUNT(field, value) profileRecord(&profile.field, (value))
+#define PROFILE_CASE(situation) __atomic_fetch_add(&profile.coalesceCases[(situation)], 1, __ATOMIC_RELAXED)
+#define PROFILE_NEW_SEARCH() (profileVisited = 0)
+#define PROFILE_VISIT() (profileVisited++)
+
+static uint64_t profileClock(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+//Registered with atexit when SF_PROFILE_FILE is set
+static void writeProfile(){
+    FILE *out = fopen(getenv("SF_PROFILE_FILE"), "w");
+    if(out != NULL){
+        sf_profile_dump(out);
+        fclose(out);
+    }
+}
+
+static void profileRecord(sf_histogram *histogram, uint64_t value){
+    if(__atomic_load_n(&profileState, __ATOMIC_RELAXED) == 0 && __atomic_exchange_n(&profileState, 1, __ATOMIC_RELAXED) == 0){
+        const char *path = getenv("SF_PROFILE_FILE");
+        if(path != NULL && *path != '\0'){
+            atexit(writeProfile);
+        }
+    }
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    if(bucket >= SF_PROFILE_BUCKETS){
+        bucket = SF_PROFILE_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&histogram -> count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram -> total, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram -> buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+#else
+#define PROFILE_START()
+#define PROFILE_END(field)
+#define PROFILE_COUNT(field, value)
+#define PROFILE_CASE(situation)
+#define PROFILE_NEW_SEARCH()
+#define PROFILE_VISIT()
+#endif
+
+//Report a failure in sf_errno. libsfmm.so stands in for the C library, so it also sets errno, which unlike
+//sf_errno belongs to the calling thread and cannot be overwritten by another thread's failure
+static void setError(int error){
+    sf_errno = error;
+#ifdef SF_PRELOAD
+    errno = error;
+#endif
+}
 
 /*
 * Simple function that satisfies malloc error requirements with one line.
@@ -28,7 +339,7 @@ static sf_block *heapEpiPtr = NULL; //this will be a pointer to the epilogue blo
 * @return NULL, also sets sf_errno to ENOMEM
 */
 static void *malloc_err(){
-    sf_errno = ENOMEM;
+    setError(ENOMEM);
     return NULL;
 }
 
@@ -59,56 +370,80 @@ static sf_block *getPrevBlock(sf_block *ptr){
     return (sf_block *) incrementPointer(-size, ptr);
 }
 
-static size_t power(size_t base, int power){
-    if(power == 0){
-        return 1;
-    }else if(power == 1){
-        return base;
-    }
-
-    size_t result = base;
-    for(int i = 0; i < power - 1; i++){
-        result = result * base; 
+//Set or clear the prev alloc bit of the block after one that was just allocated or freed. Under SF_THREADS that
+//block may sit in a thread cache whose owner tags it without the lock (see pushThreadCache), so the bit is
+//changed atomically
+static void setPrevAlloc(sf_block *ptr, int prevAlloc){
+#ifdef SF_THREADS
+    if(prevAlloc){
+        __atomic_fetch_or(&(ptr -> header), 0x2, __ATOMIC_RELAXED);
+    }else{
+        __atomic_fetch_and(&(ptr -> header), ~(sf_header) 0x2, __ATOMIC_RELAXED);
     }
-    return result;
-} 
+#else
+    ptr -> header = prevAlloc ? (ptr -> header) | 0x2 : (ptr -> header) & ~(sf_header) 0x2;
+#endif
+}
 
-//Given the size of a free block, return the correct index of the free list to insert this block in
+//Given the size of a free block, return the correct index of the free list to insert this block in. A size in
+//(MIN_BLOCK_SIZE * 2^(i-1), MIN_BLOCK_SIZE * 2^i] has (size - 1) / MIN_BLOCK_SIZE i bits long, so the index is
+//a bit scan, capped at the last list
 static int getFreeListIndex(size_t size){
     size = maskInfoBits(size);
     if(size < MIN_BLOCK_SIZE){
         return -1;
-    }else if(size == MIN_BLOCK_SIZE){
-        return 0;
-    }else if(size > (power(2, NUM_FREE_LISTS - 2)) * MIN_BLOCK_SIZE){
-        return NUM_FREE_LISTS - 1;
     }
-    for(int i = 1; i < NUM_FREE_LISTS - 1; i++){
-        size_t min = MIN_BLOCK_SIZE * power(2, i - 1);
-        size_t max = MIN_BLOCK_SIZE * power(2, i);
-        if(size > min && size <= max){
-            return i;
-        }
+    size_t multiple = (size - 1) / MIN_BLOCK_SIZE;
+    int index = multiple == 0 ? 0 : 64 - __builtin_clzll(multiple);
+    return index < NUM_FREE_LISTS - 1 ? index : NUM_FREE_LISTS - 1;
+}
+
+//Given the size of a free block, return the index of its TLSF list: the first level is the block's highest set
+//bit and the second the next TLSF_SL_LOG2 bits below it
+static int getTlsfIndex(size_t size){
+    size = maskInfoBits(size);
+    if(size < TLSF_SMALL_SIZE){
+        return size >> 3;
+    }
+    int high = 63 - __builtin_clzll(size);
+    int index = (high - TLSF_FL_SHIFT + 1) * TLSF_SL_COUNT + (int) ((size >> (high - TLSF_SL_LOG2)) - TLSF_SL_COUNT);
+    return index < TLSF_FL_COUNT * TLSF_SL_COUNT ? index : TLSF_FL_COUNT * TLSF_SL_COUNT - 1;
+}
+
+//Given a requested block size, return the first TLSF list whose blocks are all at least that big
+static int getTlsfSearchIndex(size_t size){
+    size = maskInfoBits(size);
+    if(size >= TLSF_SMALL_SIZE){
+        size += ((size_t) 1 << (63 - __builtin_clzll(size) - TLSF_SL_LOG2)) - 1;
     }
-    return NUM_FREE_LISTS - 1;
+    return getTlsfIndex(size);
+}
+
+//Given the size of a free block, return the index of the list in freeListHeads that holds it
+static int getListIndex(size_t size){
+#ifdef SF_TLSF
+    return getTlsfIndex(size);
+#else
+    return getFreeListIndex(size);
+#endif
 }
 
 //Given the size of a requested block, return the index of the quick list to check. Return -1 if size is too big for a quick list
 static int getQuickListIndex(size_t size){
-    size = maskInfoBits(size); 
-    for(int i = 0; i < NUM_QUICK_LISTS; i++){
-        size_t quickSize = MIN_BLOCK_SIZE + (i * 8);
-        if(quickSize == size){
-            return i;
-        }
-    }
-    return -1;
+    size_t index = (maskInfoBits(size) - MIN_BLOCK_SIZE) >> 3; //sizes under the minimum wrap around to huge
+    return index < NUM_QUICK_LISTS ? (int) index : -1;
+}
+
+//Given a requested payload size, return the size of the block needed to hold it
+static size_t getRequiredBlockSize(size_t size){
+    size = (size + sizeof(sf_header) + BLOCK_ALIGN - 1) & ~(size_t) (BLOCK_ALIGN - 1); //header and payload, rounded up
+    return size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : size;
 }
 
 //given a pointer to a block, determine what the current coalesce state is for that block
 enum CoalesceBlockStates {bothFree, prevFree, nextFree, bothAlloc}; 
-static int getCoalesceSituation(sf_block *ptr){
-    if(!mallocInit){
+static int getCoalesceSituation(sf_arena *arena, sf_block *ptr){
+    if(!arena -> mallocInit){
         return bothAlloc; //just for when we init malloc
     }
     if(((ptr -> header) & 0x2) > 0){//prev block is alloc
@@ -126,364 +461,2111 @@ static int getCoalesceSituation(sf_block *ptr){
     }
 }
 
-//Remove pointer in a free list
-static void removeBlockFromFreeList(sf_block *ptr){
-    sf_block *freeListHead = (sf_block *) &(sf_free_list_heads[getFreeListIndex(ptr -> header)]);
-    sf_block *cursor = freeListHead -> body.links.next; 
-    while(cursor != freeListHead){
-        if(cursor == ptr){
-            sf_block *prev = cursor -> body.links.prev; 
-            sf_block *next = cursor -> body.links.next; 
-            prev -> body.links.next = next; 
-            next -> body.links.prev = prev;
-            break;
+//Large free blocks, those of the last free list, are also kept in a treap ordered by size and then address
+//so that the best fit among them is found in O(log n). A block's tree node lives right after its list links
+//and its priority is a hash of its address, so the tree needs no memory outside the blocks.
+#define LARGE_LIST (NUM_FREE_LISTS - 1)
+typedef struct {
+    sf_block *left;
+    sf_block *right;
+} tree_node;
+
+static tree_node *getTreeNode(sf_block *block){
+    return incrementPointer(sizeof(sf_header) + 2 * sizeof(sf_block *), block);
+}
+
+static uint64_t getTreePriority(sf_block *block){
+    return ((uintptr_t) block >> 4) * 0x9e3779b97f4a7c15u;
+}
+
+//Whether block a orders before block b in the tree
+static int treeBefore(sf_block *a, sf_block *b){
+    size_t aSize = maskInfoBits(a -> header);
+    size_t bSize = maskInfoBits(b -> header);
+    return aSize < bSize || (aSize == bSize && a < b);
+}
+
+static sf_block *rotateRight(sf_block *root){
+    sf_block *left = getTreeNode(root) -> left;
+    getTreeNode(root) -> left = getTreeNode(left) -> right;
+    getTreeNode(left) -> right = root;
+    return left;
+}
+
+static sf_block *rotateLeft(sf_block *root){
+    sf_block *right = getTreeNode(root) -> right;
+    getTreeNode(root) -> right = getTreeNode(right) -> left;
+    getTreeNode(right) -> left = root;
+    return right;
+}
+
+//Insert a block into the subtree at root, returns the subtree's new root
+static sf_block *treeInsert(sf_block *root, sf_block *block){
+    if(root == NULL){
+        getTreeNode(block) -> left = NULL;
+        getTreeNode(block) -> right = NULL;
+        return block;
+    }
+    tree_node *node = getTreeNode(root);
+    if(treeBefore(block, root)){
+        node -> left = treeInsert(node -> left, block);
+        if(getTreePriority(node -> left) > getTreePriority(root)){
+            root = rotateRight(root);
+        }
+    }else{
+        node -> right = treeInsert(node -> right, block);
+        if(getTreePriority(node -> right) > getTreePriority(root)){
+            root = rotateLeft(root);
+        }
+    }
+    return root;
+}
+
+//Remove a block from the subtree at root, rotating it down until it has at most one child.
+//returns the subtree's new root
+static sf_block *treeRemove(sf_block *root, sf_block *block){
+    tree_node *node = getTreeNode(root);
+    if(root != block){
+        if(treeBefore(block, root)){
+            node -> left = treeRemove(node -> left, block);
+        }else{
+            node -> right = treeRemove(node -> right, block);
+        }
+        return root;
+    }
+    if(node -> left == NULL){
+        return node -> right;
+    }else if(node -> right == NULL){
+        return node -> left;
+    }else if(getTreePriority(node -> left) > getTreePriority(node -> right)){
+        root = rotateRight(root);
+        getTreeNode(root) -> right = treeRemove(getTreeNode(root) -> right, block);
+    }else{
+        root = rotateLeft(root);
+        getTreeNode(root) -> left = treeRemove(getTreeNode(root) -> left, block);
+    }
+    return root;
+}
+
+//Find the smallest block of at least size bytes in the tree, the lowest addressed among equals. returns null
+//if there is none
+static sf_block *treeBestFit(sf_block *root, size_t size){
+    sf_block *best = NULL;
+    while(root != NULL){
+        PROFILE_VISIT();
+        if(maskInfoBits(root -> header) >= size){
+            best = root;
+            root = getTreeNode(root) -> left;
+        }else{
+            root = getTreeNode(root) -> right;
+        }
+    }
+    return best;
+}
+
+//Find the whole pages inside a free block that can be purged without losing its header, links, tree node,
+//mark or footer. returns their length and sets *start to the first of them
+static size_t getPurgeableRange(sf_block *block, void **start){
+    uintptr_t first = ((uintptr_t) getTreeNode(block) + sizeof(tree_node) + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+    uintptr_t last = ((uintptr_t) block + maskInfoBits(block -> header) - 2 * sizeof(sf_header)) & ~(PAGE_SZ - 1);
+    *start = (void *) first;
+    return last > first ? last - first : 0;
+}
+
+//The purge mark of a free block with purgeable pages sits in the word before its footer
+static uintptr_t *getPurgeMark(sf_block *block){
+    return incrementPointer(maskInfoBits(block -> header) - 2 * sizeof(sf_header), block);
+}
+
+//Whether a free block carries a zero mark
+static int isZeroBlock(sf_block *block){
+    return maskInfoBits(block -> header) >= ZERO_MARK_MIN_SIZE && *getPurgeMark(block) == ((uintptr_t) block ^ ZERO_MARK);
+}
+
+//The bytes of a free block known to read as zero: all of them past the tree node for a zeroed block, the
+//purgeable pages for a purged one and none otherwise
+static zero_range getZeroRange(sf_block *block){
+    zero_range zero = {NULL, NULL};
+    void *start;
+    size_t bytes;
+    if(isZeroBlock(block)){
+        zero.start = (char *) getTreeNode(block) + sizeof(tree_node);
+        zero.end = (char *) getPurgeMark(block);
+    }else if((bytes = getPurgeableRange(block, &start)) > 0 && *getPurgeMark(block) == ((uintptr_t) block ^ PURGE_MARK)){
+        zero.start = start;
+        zero.end = zero.start + bytes;
+    }
+    return zero;
+}
+
+//The purgeable pages of a free block carrying a purge mark, none otherwise
+static zero_range getPurgedRange(sf_block *block){
+    zero_range purged = {NULL, NULL};
+    void *start;
+    size_t bytes = getPurgeableRange(block, &start);
+    if(bytes > 0 && *getPurgeMark(block) == ((uintptr_t) block ^ PURGE_MARK)){
+        purged.start = start;
+        purged.end = purged.start + bytes;
+    }
+    return purged;
+}
+
+//A block that merged with purged blocks stays purged: decommit its purgeable pages outside the purged ranges,
+//given in address order, and give it a purge mark. Counting the merged block as dirty instead would count the
+//decommitted pages again and have the next purge decommit them a second time
+static void carryPurge(sf_arena *arena, sf_block *block, zero_range *purged, int n){
+    void *start;
+    size_t bytes = getPurgeableRange(block, &start);
+    if(bytes == 0){
+        return;
+    }
+    char *cursor = start;
+    for(int i = 0; i < n; i++){
+        if(purged[i].start == NULL){
+            continue;
+        }
+        if(purged[i].start > cursor){
+            arena -> provider -> decommit(cursor, purged[i].start - cursor);
         }
-        cursor = cursor -> body.links.next; 
+        cursor = purged[i].end > cursor ? purged[i].end : cursor;
+    }
+    if((char *) start + bytes > cursor){
+        arena -> provider -> decommit(cursor, (char *) start + bytes - cursor);
+    }
+    *getPurgeMark(block) = (uintptr_t) block ^ PURGE_MARK;
+}
+
+//Give a free block a zero mark if every byte it would vouch for lies in a range known to be zero
+static void markZeroBlock(sf_block *block, zero_range zero){
+    if(maskInfoBits(block -> header) < ZERO_MARK_MIN_SIZE){
+        return;
+    }
+    char *start = (char *) getTreeNode(block) + sizeof(tree_node);
+    uintptr_t *mark = getPurgeMark(block);
+    if(zero.start <= start && (char *) mark <= zero.end){
+        *mark = (uintptr_t) block ^ ZERO_MARK;
+    }
+}
+
+//Clear the bytes where two zeroed free blocks meet: the lower one's mark and footer and the upper one's
+//header, links and tree node, so that the merged block is zero past its own tree node
+static void clearSeam(sf_block *upper){
+    char *start = incrementPointer(-2 * sizeof(sf_header), upper);
+    memset(start, 0, (char *) getTreeNode(upper) + sizeof(tree_node) - start);
+}
+
+//Move a free block's purgeable pages in or out of the dirty or purged byte counts
+static void countPurgeableBytes(sf_arena *arena, sf_block *block, int adding){
+    void *start;
+    size_t bytes = getPurgeableRange(block, &start);
+    if(bytes == 0){
+        return;
+    }
+    uintptr_t *mark = getPurgeMark(block);
+    size_t *count = *mark == ((uintptr_t) block ^ PURGE_MARK) ? &arena -> stats.purgedBytes : &arena -> stats.dirtyBytes;
+    if(adding){
+        *count += bytes;
+    }else{
+        *count -= bytes;
+    }
+}
+
+//Set the bitmap bits saying a free list holds at least one block
+static void markListNonEmpty(sf_arena *arena, int index){
+#ifdef SF_TLSF
+    arena -> slBitmap[index / TLSF_SL_COUNT] |= 1u << (index % TLSF_SL_COUNT);
+    arena -> freeListBitmap |= 1u << (index / TLSF_SL_COUNT);
+#else
+    arena -> freeListBitmap |= 1u << index;
+#endif
+}
+
+static void markListEmpty(sf_arena *arena, int index){
+#ifdef SF_TLSF
+    arena -> slBitmap[index / TLSF_SL_COUNT] &= ~(1u << (index % TLSF_SL_COUNT));
+    if(arena -> slBitmap[index / TLSF_SL_COUNT] == 0){
+        arena -> freeListBitmap &= ~(1u << (index / TLSF_SL_COUNT));
+    }
+#else
+    arena -> freeListBitmap &= ~(1u << index);
+#endif
+}
+
+//Remove pointer in a free list, the block's own links are used so no search of the list is needed
+static void removeBlockFromFreeList(sf_arena *arena, sf_block *ptr){
+    sf_block *prev = ptr -> body.links.prev; 
+    sf_block *next = ptr -> body.links.next; 
+    prev -> body.links.next = next; 
+    next -> body.links.prev = prev;
+    arena -> stats.freeBytes[getFreeListIndex(ptr -> header)] -= maskInfoBits(ptr -> header);
+    countPurgeableBytes(arena, ptr, FALSE);
+    //a block leaving the free lists loses its mark, since its bytes are about to be used or to become part
+    //of another block
+    arena -> takenZero = getZeroRange(ptr);
+    if(maskInfoBits(ptr -> header) >= ZERO_MARK_MIN_SIZE){
+        *getPurgeMark(ptr) = 0;
+    }
+#ifndef SF_TLSF
+    if(getFreeListIndex(ptr -> header) == LARGE_LIST){
+        arena -> largeTree = treeRemove(arena -> largeTree, ptr);
+    }
+#endif
+    if(prev == next){//only the dummy head is left so the list is now empty
+        markListEmpty(arena, getListIndex(ptr -> header));
     }
 }
 
 //Insert free block into list, assume that the header and info bits as well as footer have already been set
-static void insertBlockIntoFreeList(sf_block *ptr){
+static void insertBlockIntoFreeList(sf_arena *arena, sf_block *ptr){
+    PROFILE_START();
+    //the block stays zeroed only if everything it merges with is, its mark is set again below
+    int zero = isZeroBlock(ptr);
+    if(zero){
+        *getPurgeMark(ptr) = 0;
+    }
     //coalesce block with other free blocks
-    switch(getCoalesceSituation(ptr)){
+    int situation = getCoalesceSituation(arena, ptr);
+    zero_range purged[3] = {{NULL, NULL}, getPurgedRange(ptr), {NULL, NULL}}; //prev, this and next block
+    if(situation == prevFree || situation == bothFree){
+        purged[0] = getPurgedRange(getPrevBlock(ptr));
+    }
+    if(situation == nextFree || situation == bothFree){
+        purged[2] = getPurgedRange(getNextBlock(ptr));
+    }
+    PROFILE_CASE(situation);
+    switch(situation){
         case bothAlloc:
             break; //no coalescing possible
         case nextFree: //next block is free but prev block is alloc
             sf_block *nextBlock = getNextBlock(ptr);
-            removeBlockFromFreeList(nextBlock);
+            zero = zero && isZeroBlock(nextBlock);
+            removeBlockFromFreeList(arena, nextBlock);
             size_t nextSize = maskInfoBits(nextBlock -> header); 
             ptr -> header = (ptr -> header) + nextSize;
             (nextBlock -> header) &= 0x0; //clear header to make space for payload
             sf_block *footer = getFooterPointer(ptr);
             footer -> header = ptr -> header; 
+            if(zero){
+                clearSeam(nextBlock);
+            }
             break;
         case prevFree://prev block is free but next block is alloc 
             sf_block *prevBlock = getPrevBlock(ptr);
-            removeBlockFromFreeList(prevBlock);
+            zero = zero && isZeroBlock(prevBlock);
+            removeBlockFromFreeList(arena, prevBlock);
             prevBlock -> header = (prevBlock -> header) + maskInfoBits(ptr -> header); 
             (ptr -> header) &= 0x0; //clear header 
             sf_block *prevFreeFooter = getFooterPointer(prevBlock);
             prevFreeFooter -> header = prevBlock -> header; 
+            if(zero){
+                clearSeam(ptr);
+            }
             ptr = prevBlock;
             break;
         case bothFree:
             sf_block *bothFreePrevBlock = getPrevBlock(ptr);
-            removeBlockFromFreeList(bothFreePrevBlock);
             sf_block *bothFreeNextBlock = getNextBlock(ptr);
-            removeBlockFromFreeList(bothFreeNextBlock);
+            zero = zero && isZeroBlock(bothFreePrevBlock) && isZeroBlock(bothFreeNextBlock);
+            removeBlockFromFreeList(arena, bothFreePrevBlock);
+            removeBlockFromFreeList(arena, bothFreeNextBlock);
             bothFreePrevBlock -> header = (bothFreePrevBlock -> header) + maskInfoBits(ptr -> header) + maskInfoBits(bothFreeNextBlock -> header); 
             (bothFreeNextBlock -> header) &= 0x0;
             (ptr -> header) &= 0x0; 
             sf_block *bothFreeFooter = getFooterPointer(bothFreePrevBlock);
             bothFreeFooter -> header = bothFreePrevBlock -> header; 
+            if(zero){
+                clearSeam(ptr);
+                clearSeam(bothFreeNextBlock);
+            }
             ptr = bothFreePrevBlock;
             break; 
     }
+    if(zero){
+        *getPurgeMark(ptr) = (uintptr_t) ptr ^ ZERO_MARK;
+    }else if(situation != bothAlloc && (purged[0].start != NULL || purged[1].start != NULL || purged[2].start != NULL)){
+        carryPurge(arena, ptr, purged, 3);
+    }
     //set the prev alloc bit of the next block to 0
     sf_block *nextBlock = getNextBlock(ptr);
-    size_t nextHeader = nextBlock -> header;
-    int quickList = nextHeader & 0x4;
-    int alloc = nextHeader & 0x1;
-    nextBlock -> header = (maskInfoBits(nextHeader) | quickList) | alloc; 
-    if(alloc == FALSE){
+    setPrevAlloc(nextBlock, FALSE);
+    if(((nextBlock -> header) & 0x1) == 0){
         sf_block *footer = getFooterPointer(nextBlock);
         footer -> header = nextBlock -> header;
     }
 
-    sf_block *freeHeaderPointer = (sf_block *) &(sf_free_list_heads[getFreeListIndex(ptr -> header)]);
+    int index = getListIndex(ptr -> header);
+    sf_block *freeHeaderPointer = (sf_block *) &(arena -> freeListHeads[index]);
     ptr -> body.links.next = freeHeaderPointer -> body.links.next; //set new pointer next link to the prev first node. 
     (freeHeaderPointer -> body.links.next) -> body.links.prev = ptr;
     (freeHeaderPointer -> body.links.next) = ptr; 
     ptr -> body.links.prev = freeHeaderPointer;
+    markListNonEmpty(arena, index);
+#ifndef SF_TLSF
+    if(index == LARGE_LIST){
+        arena -> largeTree = treeInsert(arena -> largeTree, ptr);
+    }
+#endif
+    arena -> stats.freeBytes[getFreeListIndex(ptr -> header)] += maskInfoBits(ptr -> header);
+    countPurgeableBytes(arena, ptr, TRUE);
+    PROFILE_END(coalesce);
+}
+
+static void countQuickListMiss(sf_arena *arena, int index){
+    arena -> stats.quickListMisses[index]++;
+    if(arena -> quickMisses[index] >= 0){
+        arena -> quickMisses[index]++;
+    }
 }
 
 //search quick lists for a block of correct size, LIFO like a stack
 //returns null if no quick list block is found
-static sf_block *searchQuickLists(size_t size){
+static sf_block *searchQuickLists(sf_arena *arena, size_t size){
+    PROFILE_START();
     int quickIndex = getQuickListIndex(size);
     if(quickIndex != -1){//if quickIndex = -1 then requested block is too big to be on a quick list
-        int quickLength = sf_quick_lists[quickIndex].length; 
+        int quickLength = arena -> quickLists[quickIndex].length; 
         if(quickLength != 0){
-            sf_block *ptr = (sf_block *) sf_quick_lists[quickIndex].first;
-            sf_quick_lists[quickIndex].length = quickLength - 1;
-            sf_quick_lists[quickIndex].first = ptr -> body.links.next; 
+            sf_block *ptr = (sf_block *) arena -> quickLists[quickIndex].first;
+            arena -> quickLists[quickIndex].length = quickLength - 1;
+            arena -> quickLists[quickIndex].first = ptr -> body.links.next; 
+            ptr -> header = (ptr -> header) & ~0x4; //block is no longer in a quick list
+            arena -> stats.quickListBytes[quickIndex] -= maskInfoBits(ptr -> header);
+            arena -> stats.quickListHits[quickIndex]++;
+            PROFILE_END(quickListHit);
             return ptr; 
         }
+        countQuickListMiss(arena, quickIndex);
     }
     return NULL;
 }
 
-static void *splitBlock(size_t freeBlockSize, size_t size, sf_block *ptr){
-    if(freeBlockSize - size >= 32){
+//Move ptrs[root] down the max-heap of the first n pointers until neither child has a higher address
+static void siftAddress(void **ptrs, size_t root, size_t n){
+    void *value = ptrs[root];
+    for(size_t child = 2 * root + 1; child < n; child = 2 * root + 1){
+        if(child + 1 < n && (uintptr_t) ptrs[child + 1] > (uintptr_t) ptrs[child]){
+            child++;
+        }
+        if((uintptr_t) ptrs[child] <= (uintptr_t) value){
+            break;
+        }
+        ptrs[root] = ptrs[child];
+        root = child;
+    }
+    ptrs[root] = value;
+}
+
+//Sort pointers by address with a heapsort. qsort is not used because it may call malloc, which with sfmm
+//preloaded as the process's malloc would come back into the arena whose lock is held
+static void sortAddresses(void **ptrs, size_t n){
+    if(n < 2){
+        return;
+    }
+    for(size_t i = n / 2; i > 0; i--){
+        siftAddress(ptrs, i - 1, n);
+    }
+    for(size_t end = n - 1; end > 0; end--){
+        void *largest = ptrs[0];
+        ptrs[0] = ptrs[end];
+        ptrs[end] = largest;
+        siftAddress(ptrs, 0, end);
+    }
+}
+
+//Empty every quick list into the free lists at once, like dlmalloc's malloc_consolidate: the blocks are sorted
+//by address so each run of adjacent ones becomes a single free block with one set of neighbour checks and
+//list edits. returns the number of blocks taken off the quick lists
+static size_t consolidateArena(sf_arena *arena){
+    PROFILE_START();
+    void *blocks[NUM_QUICK_LISTS * QUICK_LIST_CAP_MAX];
+    size_t count = 0;
+    for(int i = 0; i < NUM_QUICK_LISTS; i++){
+        for(sf_block *cursor = arena -> quickLists[i].first; cursor != NULL; cursor = cursor -> body.links.next){
+            blocks[count++] = cursor;
+        }
+        arena -> quickLists[i].first = NULL;
+        arena -> quickLists[i].length = 0;
+        arena -> stats.quickListBytes[i] = 0;
+    }
+    sortAddresses(blocks, count);
+
+    for(size_t i = 0; i < count;){
+        sf_block *run = blocks[i];
+        size_t size = maskInfoBits(run -> header);
+        for(i++; i < count && blocks[i] == incrementPointer(size, run); i++){
+            size += maskInfoBits(((sf_block *) blocks[i]) -> header);
+            ((sf_block *) blocks[i]) -> header = 0; //clear header to make space for payload
+        }
+        run -> header = size | ((run -> header) & 0x2);
+        sf_block *footer = getFooterPointer(run);
+        footer -> header = run -> header;
+        insertBlockIntoFreeList(arena, run); //merges the run with free blocks on either side
+    }
+    PROFILE_END(consolidate);
+    return count;
+}
+
+//Count the leftover of a block handed out whole because the leftover was too small to split off
+static void countSplinter(sf_arena *arena, size_t leftover){
+    if(leftover > 0){
+        arena -> stats.splinterAllocs++;
+        arena -> stats.splinterAllocBytes += leftover;
+    }
+}
+
+//Split an allocated block of freeBlockSize bytes at size, returning the rest to the free lists. zero is the
+//range of the original free block known to read as zero, which the rest keeps its zero mark through
+static void *splitBlock(sf_arena *arena, size_t freeBlockSize, size_t size, sf_block *ptr, zero_range zero){
+    if(freeBlockSize - size >= MIN_BLOCK_SIZE){
         //proceed to split block
         ptr -> header = size | ((ptr -> header & 0x7) | 0x1); //info bits (quickList = 0) (prevAlloc = 1 or 0 depending on orig header) (alloc = 1)
         sf_block *remainder = incrementPointer(size, ptr); 
         remainder -> header = (freeBlockSize - size) | 0x2; //info bits (quickList = 0) (prevAlloc = 1) (alloc = 0) 
-        insertBlockIntoFreeList(remainder);
+        markZeroBlock(remainder, zero);
+        insertBlockIntoFreeList(arena, remainder);
         sf_block *footer = getFooterPointer(remainder); 
         footer -> header = remainder -> header; 
         return ptr; //return original pointer
     }else{//otherwise we do not want to split the block and will just allocate a much larger block
+        countSplinter(arena, freeBlockSize - size);
         return ptr; 
     }
 }
 
-//search free list for a big enough block, returns a new allocated block
-//will split block and do neccessary things for that.
+//Unlink and return the first block of at least size bytes in one free list, looking no further than its
+//first block unless wholeList is set. returns null if none is found
+static sf_block *takeFromList(sf_arena *arena, int index, size_t size, int wholeList){
+    sf_block *head = &(arena -> freeListHeads[index]);
+    sf_block *cursor = head -> body.links.next;
+    while(cursor != head){
+        PROFILE_VISIT();
+        size_t cursorSize = maskInfoBits(cursor -> header);
+        if(cursorSize >= size){
+            removeBlockFromFreeList(arena, cursor); //break links in free list for block we are returning
+            return cursor;
+        }else if(!wholeList){
+            return NULL;
+        }else{
+            cursor = cursor -> body.links.next; 
+        }
+    }
+    return NULL;
+}
+
+#ifdef SF_TLSF
+//Good fit in constant time: every block in a list at or past the request's search index is big enough, so take
+//the first block of the first non-empty one. Only the catch-all last list has to be searched.
 //will return null if there is no block found big enough
-static sf_block *searchFreeLists(size_t size){
-    sf_block *ptr = NULL;
-    for(int i = getFreeListIndex(size); i < NUM_FREE_LISTS; i++){
-        sf_block *head = &(sf_free_list_heads[i]);
-        sf_block *cursor = head;
-        if(cursor -> body.links.next != head){
-            cursor = cursor -> body.links.next;
-            while(cursor != head){
-                size_t cursorSize = maskInfoBits(cursor -> header);
-                if(cursorSize >= size){
-                    ptr = cursor; 
-                    //break links in free list for block we are returning
-                    (cursor -> body.links.prev) -> body.links.next = cursor -> body.links.next; 
-                    (cursor -> body.links.next) -> body.links.prev = cursor -> body.links.prev; 
-                    break;
-                }else{
-                    cursor = cursor -> body.links.next; 
-                }
+static sf_block *takeFreeBlock(sf_arena *arena, size_t size){
+    int index = getTlsfSearchIndex(size);
+    int fl = index / TLSF_SL_COUNT;
+    unsigned int slMap = arena -> slBitmap[fl] & (~0u << (index % TLSF_SL_COUNT));
+    if(slMap == 0){
+        unsigned int flMap = fl + 1 < TLSF_FL_COUNT ? arena -> freeListBitmap & (~0u << (fl + 1)) : 0;
+        if(flMap == 0){
+            //the list the request itself falls in may still start with a big enough block, such as the
+            //free block extendHeap just grew, which is better than growing the heap again
+            return takeFromList(arena, getTlsfIndex(size), size, FALSE);
+        }
+        fl = __builtin_ctz(flMap);
+        slMap = arena -> slBitmap[fl];
+    }
+    index = fl * TLSF_SL_COUNT + __builtin_ctz(slMap);
+    return takeFromList(arena, index, size, index == FREE_LIST_COUNT - 1);
+}
+#else
+//search free lists for the first block of at least size bytes and unlink it without splitting, taking the
+//best fit from the tree once the search reaches the last list
+//will return null if there is no block found big enough
+static sf_block *takeFreeBlock(sf_arena *arena, size_t size){
+    //only visit lists that are non-empty and whose size class can hold the request
+    unsigned int candidates = arena -> freeListBitmap & (~0u << getFreeListIndex(size));
+    while(candidates != 0){
+        int i = __builtin_ctz(candidates);
+        candidates &= candidates - 1; //clear lowest set bit
+        if(i == LARGE_LIST){
+            sf_block *best = treeBestFit(arena -> largeTree, size);
+            if(best != NULL){
+                removeBlockFromFreeList(arena, best);
             }
+            return best;
         }
-        if(ptr != NULL){
-            break;
+        sf_block *block = takeFromList(arena, i, size, TRUE);
+        if(block != NULL){
+            return block;
         }
     }
+    return NULL;
+}
+#endif
 
+//search free list for a big enough block, returns a new allocated block
+//will split block and do neccessary things for that. if zero is not null it is set to the bytes of the
+//block known to read as zero
+//will return null if there is no block found big enough
+static sf_block *searchFreeLists(sf_arena *arena, size_t size, zero_range *zero){
+    PROFILE_START();
+    PROFILE_NEW_SEARCH();
+    sf_block *ptr = takeFreeBlock(arena, size);
+    PROFILE_END(freeListSearch);
+    PROFILE_COUNT(nodesVisited, profileVisited);
     if(ptr != NULL){
         size_t freeBlockSize = maskInfoBits(ptr -> header);
-        return splitBlock(freeBlockSize, size, ptr);
+        if(zero != NULL){
+            *zero = arena -> takenZero;
+        }
+        return splitBlock(arena, freeBlockSize, size, ptr, arena -> takenZero);
     }else{
         return NULL;
     }
 }
 
+//Reserve the range an arena's heap will grow in, returns false if the provider has no room
+static int reserveArena(sf_arena *arena, size_t size){
+    void *start = arena -> provider -> reserve(size);
+    if(start == NULL){
+        return FALSE;
+    }
+    arena -> memStart = start;
+    arena -> memEnd = start;
+    arena -> committedEnd = start;
+    arena -> memLimit = incrementPointer(size, start);
+    arena -> regionSize = size;
+    return TRUE;
+}
+
+//Get up to *pages more pages right after the end of an arena's heap, committing them as needed. Sets
+//*pages to the number obtained and returns the first of them, or NULL if not even one page was available
+static void *growArena(sf_arena *arena, size_t *pages){
+    size_t obtained = ((uintptr_t) arena -> memLimit - (uintptr_t) arena -> memEnd) / PAGE_SZ;
+    if(obtained > *pages){
+        obtained = *pages;
+    }
+    void *end = incrementPointer(obtained * PAGE_SZ, arena -> memEnd);
+    if(end > arena -> committedEnd){
+        size_t shortfall = (uintptr_t) end - (uintptr_t) arena -> committedEnd;
+        shortfall = (shortfall + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+        size_t committed = arena -> provider -> commit(arena -> committedEnd, shortfall);
+        arena -> committedEnd = incrementPointer(committed, arena -> committedEnd);
+        if(end > arena -> committedEnd){//the provider ran out part way, keep the pages it did commit
+            obtained = ((uintptr_t) arena -> committedEnd - (uintptr_t) arena -> memEnd) / PAGE_SZ;
+        }
+    }
+    *pages = obtained;
+    if(obtained == 0){
+        return NULL;
+    }
+    void *start = arena -> memEnd;
+    arena -> memEnd = incrementPointer(obtained * PAGE_SZ, start);
+    arena -> stats.heapSize += obtained * PAGE_SZ;
+    if(arena -> stats.heapSize > arena -> stats.peakHeapSize){
+        arena -> stats.peakHeapSize = arena -> stats.heapSize;
+    }
+    return start;
+}
+
+//Publish where an arena's heap ends. Under SF_THREADS validatePointer reads the bounds without the lock
+static void setEpilogue(sf_arena *arena, sf_block *epilogue){
+    __atomic_store_n(&(arena -> heapEpiPtr), epilogue, __ATOMIC_RELEASE);
+}
 
+//Grow the heap so that the free block at its end holds at least size bytes, adding all new pages as one
+//free block. Under geometric growth the heap grows by at least its current size (up to MAX_GEOMETRIC_GROWTH)
+//when the memory is there. returns false if the heap could not grow at all
+static int extendHeap(sf_arena *arena, size_t size){
+    PROFILE_START();
+    size_t trailing = 0;
+    if(((arena -> heapEpiPtr -> header) & 0x2) == 0){//last block is free and will absorb the new pages
+        trailing = maskInfoBits(getPrevBlock(arena -> heapEpiPtr) -> header);
+    }
+    size_t shortfall = size > trailing ? size - trailing : 1;
+    size_t minPages = shortfall / PAGE_SZ + (shortfall % PAGE_SZ != 0);
+    size_t pages = minPages;
+    if(heapGrowth == SF_GROWTH_GEOMETRIC){
+        size_t step = arena -> stats.heapSize < MAX_GEOMETRIC_GROWTH ? arena -> stats.heapSize : MAX_GEOMETRIC_GROWTH;
+        if(step / PAGE_SZ > pages){
+            pages = step / PAGE_SZ;
+        }
+    }
 
-static int extendHeap(){
-    if(sf_mem_grow() == NULL){
+    void *start = growArena(arena, &pages);
+    if(start == NULL){
+        PROFILE_END(extendHeap);
         return FALSE;
     }
 
-    int prevAlloc = (heapEpiPtr -> header) & 0x2;
-    size_t size = PAGE_SZ;
-    heapEpiPtr -> header = size | prevAlloc;
+    int prevAlloc = (arena -> heapEpiPtr -> header) & 0x2;
+    size = pages * PAGE_SZ;
+    arena -> heapEpiPtr -> header = size | prevAlloc;
 
-    sf_block *footer = getFooterPointer(heapEpiPtr);
-    footer -> header = heapEpiPtr -> header; 
+    sf_block *footer = getFooterPointer(arena -> heapEpiPtr);
+    footer -> header = arena -> heapEpiPtr -> header; 
 
-    heapEpiPtr = (sf_block *) incrementPointer(-sizeof(sf_header), sf_mem_end());
-    heapEpiPtr -> header = 0x1; //allocated block and prev alloc is always gonna be 0
+    setEpilogue(arena, (sf_block *) incrementPointer(size - sizeof(sf_header), start));
+    arena -> heapEpiPtr -> header = 0x1; //allocated block and prev alloc is always gonna be 0
 
-    insertBlockIntoFreeList(incrementPointer(-size, heapEpiPtr));
+    //past the old epilogue's header the block is all fresh pages, see sf_provider
+    sf_block *block = incrementPointer(-size, arena -> heapEpiPtr);
+    *getPurgeMark(block) = (uintptr_t) block ^ ZERO_MARK;
+    insertBlockIntoFreeList(arena, block);
+    PROFILE_END(extendHeap);
     return TRUE;
 }
 
-/*
- * This is your implementation of sf_malloc. It acquires uninitialized memory that
- * is aligned and padded properly for the underlying system.
- *
- * @param size The number of bytes requested to be allocated.
- *
- * @return If size is 0, then NULL is returned without setting sf_errno.
- * If size is nonzero, then if the allocation is successful a pointer to a valid region of
- * memory of the requested size is returned.  If the allocation is not successful, then
- * NULL is returned and sf_errno is set to ENOMEM.
- */
-void *sf_malloc(size_t size) {
-    if(size == 0)
-        return NULL;
+//Set up an arena's heap on its first allocation: prologue, epilogue and one free block.
+//returns false if the first page could not be obtained
+static int initHeap(sf_arena *arena){
+    //grow the arena by a page of memory, initalize the prologue and inital epilogue
+    //then remainder of free memory should be inserted into the free list as one block
+    if(arena -> memStart == NULL && reserveArena(arena, MAIN_HEAP_RESERVE) == FALSE){
+        return FALSE;
+    }
+    size_t pages = 1;
+    void *start = growArena(arena, &pages);//returns a pointer to the start of new memory page
+    if(start == NULL){
+        return FALSE;
+    }
+    arena -> heapProPtr = incrementPointer(PROLOGUE_OFFSET, start);
 
-    if(!mallocInit){//first time calling malloc so we will want to initalize.
-        //call sf_mem_grow to obtain a page of memory, initalize the prologue and inital epilogue
-        //then remainder of free memory should be inserted into the free list as one block
-        heapProPtr = sf_mem_grow();//returns a pointer to the start of new memory page
-        if(heapProPtr == NULL){
-            return malloc_err();
-        }
+    //init free lists
+    for(int i = 0; i < FREE_LIST_COUNT; i++){//set up dummy heads
+        sf_block *dummy = &(arena -> freeListHeads[i]);
+        dummy -> body.links.next = dummy;
+        dummy -> body.links.prev = dummy;
+    }  
+    arena -> freeListBitmap = 0;
+    arena -> largeTree = NULL;
+    for(int i = 0; i < NUM_QUICK_LISTS; i++){
+        arena -> quickCapacity[i] = QUICK_LIST_CAP_MIN;
+        arena -> quickMisses[i] = -1;
+    }
+#ifdef SF_TLSF
+    memset(arena -> slBitmap, 0, sizeof(arena -> slBitmap));
+#endif
 
-        //init free lists
-        for(int i = 0; i < NUM_FREE_LISTS; i++){//set up dummy heads
-            sf_block *dummy = &(sf_free_list_heads[i]);
-            dummy -> body.links.next = dummy;
-            dummy -> body.links.prev = dummy;
-        }  
+    //Create the prologue block
+    sf_block *prologue = (arena -> heapProPtr);
+    prologue -> header = MIN_BLOCK_SIZE | 0x1; 
+    *(prologue -> body.payload) = 0x0;
+    
+    //Create the epilogue header
+    sf_block *epilogue = (sf_block *) (incrementPointer(PAGE_SZ - sizeof(sf_header), start));
+    epilogue -> header = 0x1; //size 0 but we have an allocated block so 0x1
+    setEpilogue(arena, epilogue);
 
-        //Create the prologue block
-        sf_block *prologue = (heapProPtr);
-        prologue -> header = MIN_BLOCK_SIZE | 0x1; 
-        *(prologue -> body.payload) = 0x0;
-        
-        //Create the epilogue header
-        sf_block *epilogue = (sf_block *) (incrementPointer(-sizeof(sf_header), sf_mem_end()));
-        epilogue -> header = 0x1; //size 0 but we have an allocated block so 0x1
-        heapEpiPtr = epilogue;
+    //Create the free block
+    sf_block *freeBlock = (sf_block *) incrementPointer(MIN_BLOCK_SIZE, arena -> heapProPtr);
+    size_t freeBlockSize = (PAGE_SZ - PROLOGUE_OFFSET - MIN_BLOCK_SIZE - sizeof(sf_header)) | 0x2;//4096 - 32 (prologue) - 8 (epilogue) | (qlist = 1) (prev alloc = 1) (alloc = 0)
+    freeBlock -> header = freeBlockSize;
+    *getPurgeMark(freeBlock) = (uintptr_t) freeBlock ^ ZERO_MARK; //the page is fresh
 
-        //Create the free block
-        sf_block *freeBlock = (sf_block *) incrementPointer(MIN_BLOCK_SIZE, heapProPtr);
-        size_t freeBlockSize = (PAGE_SZ - MIN_BLOCK_SIZE - sizeof(sf_header)) | 0x2;//4096 - 32 (prologue) - 8 (epilogue) | (qlist = 1) (prev alloc = 1) (alloc = 0)
-        freeBlock -> header = freeBlockSize;
+    //insert newly created free block into free list
+    insertBlockIntoFreeList(arena, freeBlock);
 
-        //insert newly created free block into free list
-        insertBlockIntoFreeList(freeBlock);
+    //footer of free block
+    sf_block *footer = (sf_block *) getFooterPointer(freeBlock);
+    footer -> header = (freeBlock -> header);
 
-        //footer of free block
-        sf_block *footer = (sf_block *) getFooterPointer(freeBlock);
-        footer -> header = (freeBlock -> header);
+    __atomic_store_n(&(arena -> mallocInit), TRUE, __ATOMIC_RELEASE); //we have initalized malloc, bounds included
+    return TRUE;
+}
 
-        mallocInit = TRUE; //we have initalized malloc
+//Allocate a block for a nonzero payload size from an arena, initalizing its heap on first use. If zero is
+//not null it is set to the bytes of the block known to read as zero
+static void *allocateBlock(sf_arena *arena, size_t size, zero_range *zero){
+    if(!arena -> mallocInit && initHeap(arena) == FALSE){//first time calling malloc so we will want to initalize.
+        return malloc_err();
     }
 
     //calculate required size of free block needed
-    size = size + sizeof(sf_header); //allocated blocks consists of header and payload
-    if(size < MIN_BLOCK_SIZE){
-        size = MIN_BLOCK_SIZE;
-    }else{
-        while((size & 0x7) > 0){ //make size a multiple 8 if not
-            size++;
-        }
-    }
+    size = getRequiredBlockSize(size);
 
-    sf_block *ptr = searchQuickLists(size);
+    sf_block *ptr = searchQuickLists(arena, size);
+    if(ptr != NULL && zero != NULL){
+        *zero = (zero_range) {NULL, NULL};
+    }
     if(ptr == NULL){//if we did not find a ptr to a free block in the quick lists, proceed to search free list
-        ptr = searchFreeLists(size);
+        ptr = searchFreeLists(arena, size, zero);
         while(ptr == NULL){//Request new page of memory and create free block from it if size is bigger than any avail free block 
-            if(extendHeap() == FALSE){//extend heap was not successful
+            //deferred frees may merge into a big enough block, grow the heap only when there are none left
+            if(consolidateArena(arena) == 0 && extendHeap(arena, size) == FALSE){//extend heap was not successful
                 return malloc_err();
             }
-            ptr = searchFreeLists(size);
+            ptr = searchFreeLists(arena, size, zero);
         }
     }
-    sf_block *next = getNextBlock(ptr);
-    next -> header = (next -> header) | 0x2; //set prev alloc bit of next block
+    setPrevAlloc(getNextBlock(ptr), TRUE);
     ptr -> header = (ptr -> header) | 0x1; //set alloc field if split block did not do it
     return ptr -> body.payload;
 }
 
-//returns true if the block was put into a quick list and returns false if it was not inserted into a quick list
-static int insertBlockIntoQuickList(sf_block *ptr){
-    int index = getQuickListIndex(ptr -> header); 
-    if(index != -1){
-        int quickLength = sf_quick_lists[index].length;
-        if(quickLength == QUICK_LIST_MAX){//flush quick list
-            sf_block *cursor = sf_quick_lists[index].first; 
-            while(cursor != NULL){//cursor -> body.links.next != NULL
-                int prevAlloc = (cursor -> header) & 0x2; //extract prev alloc bit
-                size_t size = maskInfoBits(cursor -> header); //mask info bits so that we can make the header a free block not in quicklist
-                size = (size | (prevAlloc));//set the prev alloc bit if it was set in the header before
-                cursor -> header = size; 
-                sf_block *footer = getFooterPointer(cursor); 
-                footer -> header = cursor -> header; 
-                sf_quick_lists[index].first = cursor -> body.links.next; //remove block from quick list
-                insertBlockIntoFreeList(cursor); 
-                cursor = sf_quick_lists[index].first; 
-            }
-            sf_quick_lists[index].first = NULL;
-            quickLength = 0; 
-        }
-        quickLength++;
-        sf_quick_lists[index].length = quickLength;
-        if(sf_quick_lists[index].first != NULL){
-            ptr -> header = (ptr -> header) | 0x4; //set the in quick list bit
-            ptr -> body.links.next = sf_quick_lists[index].first;
-            sf_quick_lists[index].first = ptr; 
-        }else{
-            ptr -> header = (ptr -> header) | 0x4; //set the in quick list bit
-            ptr -> body.links.next = NULL;
-            sf_quick_lists[index].first = ptr; 
-        }
-        return TRUE;
-    }else{
-        return FALSE; 
-    }
+static void *mallocBlock(sf_arena *arena, size_t size){
+    return allocateBlock(arena, size, NULL);
 }
 
-int validatePointer(void *pp){
+//Allocate a block of size zeroed bytes from an arena, clearing only those not already known to be zero
+static void *callocBlock(sf_arena *arena, size_t size){
+    zero_range zero;
+    char *pp = allocateBlock(arena, size, &zero);
     if(pp == NULL){
-        return FALSE;
+        return NULL;
+    }
+    char *end = pp + size;
+    if(zero.start >= end || zero.end <= pp){
+        memset(pp, 0, size);
+        return pp;
     }
+    if(zero.start > pp){
+        memset(pp, 0, zero.start - pp);
+    }
+    if(zero.end < end){
+        memset(zero.end, 0, end - zero.end);
+    }
+    arena -> stats.callocSkippedBytes += (zero.end < end ? zero.end : end) - (zero.start > pp ? zero.start : pp);
+    return pp;
+}
 
-    sf_block *block = (sf_block *) pp; 
-    block = incrementPointer(-sizeof(sf_header), block);
-    size_t size = maskInfoBits(block -> header); 
+//Length of the mapping for a mapped block with a payload of size bytes starting offset bytes into it, 0 if it
+//would overflow
+static size_t getMappedLength(size_t size, size_t offset){
+    size_t length = (size + offset + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+    return length < size ? 0 : length;
+}
 
-    if(pp < (((void *) heapProPtr) + 32) 
-        || ((uintptr_t) pp & 0x7) > 0 
-        || size < 32 
-        || (size & 0x7) > 0
-        || pp >= ((void *) heapEpiPtr) 
-        || getFooterPointer(block) >= ((void *) heapEpiPtr) 
-        || ((block -> header) & 0x4) > 0
-        || ((block -> header) & 0x1) == 0
-        || !mallocInit){
-            return FALSE;
-    }
+//Start of the mapping holding a mapped block, the page holding the length word before its header
+static void *getMapStart(void *pp){
+    return (void *) (((uintptr_t) pp - 2 * sizeof(sf_header)) & ~(PAGE_SZ - 1));
+}
 
-    if(((block -> header) & 0x2) == 0){ //get prev alloc bit
-        sf_block *prevHeader = getPrevBlock(pp);
-        if(((prevHeader -> header) & 0x1) < 0){
-            return FALSE;
-        }
+//Check whether pp is the payload of a block made by mapBlock or mapAlignedBlock rather than a heap block
+static int isMappedBlock(void *pp){
+    uintptr_t pageOffset = (uintptr_t) pp & (PAGE_SZ - 1);
+    if(pp == NULL || (pageOffset != 2 * sizeof(sf_header) && pageOffset != 0)){
+        return FALSE;
     }
+    sf_block *block = incrementPointer(-sizeof(sf_header), pp);
+    size_t *length = incrementPointer(-2 * sizeof(sf_header), pp);
+    size_t offset = (uintptr_t) pp - (uintptr_t) getMapStart(pp);
+    return ((block -> header) & MAPPED_BLOCK_MASK) == MAPPED_BLOCK
+        && *length == maskInfoBits(block -> header) + offset - sizeof(sf_header);
+}
 
-    return TRUE;
+//Record a mapping of oldLength bytes becoming one of newLength bytes, either may be 0
+static void countMappedBytes(size_t oldLength, size_t newLength){
+    COUNT_CALLS(&mainArena, mappedBytes, newLength - oldLength);
+    COUNT_CALLS(&mainArena, mappedBlocks, (size_t) (newLength != 0) - (oldLength != 0));
 }
 
-/*
+//Write the length and header of a mapped block whose payload starts offset bytes into its mapping and
+//return the payload
+static void *initMappedBlock(void *map, size_t length, size_t offset){
+    sf_block *block = incrementPointer(offset - sizeof(sf_header), map);
+    *(size_t *) incrementPointer(-sizeof(sf_header), block) = length;
+    block -> header = (length - offset + sizeof(sf_header)) | MAPPED_BLOCK;
+    return block -> body.payload;
+}
+
+//Allocate a block with a payload of size bytes in a mapping of its own
+static void *mapBlock(size_t size){
+    size_t length = getMappedLength(size, MAPPED_PAYLOAD_OFFSET);
+    if(length == 0){
+        return malloc_err();
+    }
+    void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED){
+        return malloc_err();
+    }
+    countMappedBytes(0, length);
+    return initMappedBlock(map, length, MAPPED_PAYLOAD_OFFSET);
+}
+
+//Allocate a block with a payload of size bytes aligned to align, at least a page, in a mapping of its own.
+//Enough extra address space is mapped to find an aligned payload in it and the unused ends are unmapped again
+static void *mapAlignedBlock(size_t size, size_t align){
+    size_t length = getMappedLength(size, PAGE_SZ);
+    size_t slack = align - PAGE_SZ;
+    if(length == 0 || length + slack < length){
+        return malloc_err();
+    }
+    char *map = mmap(NULL, length + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED){
+        return malloc_err();
+    }
+    char *start = (char *) ((((uintptr_t) map + PAGE_SZ + align - 1) & ~(align - 1)) - PAGE_SZ);
+    if(start > map){
+        munmap(map, start - map);
+    }
+    if(start + length < map + length + slack){
+        munmap(start + length, map + slack - start);
+    }
+    countMappedBytes(0, length);
+    return initMappedBlock(start, length, PAGE_SZ);
+}
+
+//Give the mapping of a mapped block back to the system
+static void unmapBlock(void *pp){
+    void *map = getMapStart(pp);
+    size_t length = *(size_t *) incrementPointer(-2 * sizeof(sf_header), pp);
+    munmap(map, length);
+    countMappedBytes(length, 0);
+}
+
+//Resize a mapped block. A block that stays at or above the threshold is remapped, so its pages move
+//without being copied; one that drops below it moves into the heap
+static void *reallocMappedBlock(void *pp, size_t rsize){
+    if(rsize == 0){
+        unmapBlock(pp);
+        return NULL;
+    }
+    void *map = getMapStart(pp);
+    size_t offset = (uintptr_t) pp - (uintptr_t) map;
+    size_t oldLength = *(size_t *) incrementPointer(-2 * sizeof(sf_header), pp);
+    size_t length = getMappedLength(rsize, offset);
+    if(length == oldLength){//fits, and no page would be given back, even if rsize is now under the threshold
+        COUNT_CALLS(&mainArena, realloc.fitted, 1);
+        return pp;
+    }
+    if(rsize < mmapThreshold){
+        LOCK_ARENA(&mainArena);
+        void *smaller = mallocBlock(&mainArena, rsize);
+        UNLOCK_ARENA(&mainArena);
+        if(smaller == NULL){ //sf_errno is set by mallocBlock
+            return NULL;
+        }
+        size_t payloadSize = oldLength - offset;
+        memcpy(smaller, pp, rsize < payloadSize ? rsize : payloadSize);
+        unmapBlock(pp);
+        return smaller;
+    }
+
+    if(length == 0){
+        return malloc_err();
+    }
+    void *newMap = mremap(map, oldLength, length, MREMAP_MAYMOVE);
+    if(newMap == MAP_FAILED){
+        return malloc_err();
+    }
+    countMappedBytes(oldLength, length);
+    return initMappedBlock(newMap, length, offset); //the payload keeps its offset, and so its page alignment
+}
+
+/*
+ * Sets the size at and above which sf_malloc and sf_realloc give a block a mapping of its
+ * own, which is returned to the system as soon as the block is freed.  Should be called
+ * before other threads allocate.
+ *
+ * @param size The new threshold in bytes, SIZE_MAX to keep every block in the heap.
+ *
+ * @return The previous threshold.
+ */
+size_t sf_set_mmap_threshold(size_t size){
+    size_t old = mmapThreshold;
+    mmapThreshold = size;
+    return old;
+}
+
+/*
+ * Chooses how the heaps grow when no free block is large enough.
+ *
+ * @param policy SF_GROWTH_EXACT to grow by just enough pages for the request, or
+ * SF_GROWTH_GEOMETRIC to grow by at least the current heap size (at most 1MB at a time),
+ * which takes fewer, larger steps when a heap keeps growing.
+ *
+ * @return The previous policy.
+ */
+int sf_set_heap_growth(int policy){
+    int old = heapGrowth;
+    heapGrowth = policy;
+    return old;
+}
+
+/*
+ * Chooses where the heap behind sf_malloc gets its memory.  Must be called before the
+ * first allocation.
+ *
+ * @param provider &sf_mmap_provider for a heap that can grow to 4GB, &sf_sfutil_provider
+ * for the fixed sfutil region, or a provider of the caller's own.
+ *
+ * @return 0 on success, or -1 with sf_errno set to EINVAL if the heap is already in use.
+ */
+int sf_set_provider(const sf_provider *provider){
+    LOCK_ARENA(&mainArena);
+    int inUse = mainArena.memStart != NULL;
+    if(!inUse){
+        mainArena.provider = provider;
+    }
+    UNLOCK_ARENA(&mainArena);
+    if(inUse){
+        setError(EINVAL);
+        return -1;
+    }
+    return 0;
+}
+
+//Move the oldest blocks of a full quick list to the free lists, after adapting its capacity. returns the
+//number of blocks left in the list
+static int flushQuickList(sf_arena *arena, int index){
+    int capacity = arena -> quickCapacity[index];
+    if(arena -> quickMisses[index] > 0 && capacity < QUICK_LIST_CAP_MAX){
+        arena -> quickCapacity[index] = capacity * 2 < QUICK_LIST_CAP_MAX ? capacity * 2 : QUICK_LIST_CAP_MAX;
+        arena -> quickMisses[index] = 0;
+        return capacity; //room was made without flushing
+    }else if(arena -> quickMisses[index] == 0 && capacity > QUICK_LIST_CAP_MIN){
+        capacity = capacity / 2 > QUICK_LIST_CAP_MIN ? capacity / 2 : QUICK_LIST_CAP_MIN;
+        arena -> quickCapacity[index] = capacity;
+    }
+    arena -> quickMisses[index] = 0;
+    arena -> stats.quickListFlushes[index]++;
+
+    //keep the newest half at the front of the list and cut the rest off, all of it at a capacity of 1
+    int keep = capacity / 2;
+    sf_block *cursor = arena -> quickLists[index].first;
+    if(keep == 0){
+        arena -> quickLists[index].first = NULL;
+    }else{
+        sf_block *last = cursor;
+        for(int i = 1; i < keep; i++){
+            last = last -> body.links.next;
+        }
+        cursor = last -> body.links.next;
+        last -> body.links.next = NULL;
+    }
+    while(cursor != NULL){
+        sf_block *next = cursor -> body.links.next;
+        int prevAlloc = (cursor -> header) & 0x2; //extract prev alloc bit
+        size_t size = maskInfoBits(cursor -> header); //mask info bits so that we can make the header a free block not in quicklist
+        size = (size | (prevAlloc));//set the prev alloc bit if it was set in the header before
+        cursor -> header = size; 
+        sf_block *footer = getFooterPointer(cursor); 
+        footer -> header = cursor -> header; 
+        arena -> stats.quickListBytes[index] -= maskInfoBits(cursor -> header);
+        insertBlockIntoFreeList(arena, cursor); 
+        cursor = next;
+    }
+    return keep;
+}
+
+//Same as insertBlockIntoQuickList, for a caller that already knows the quick list index (or -1)
+static int insertBlockIntoQuickListAt(sf_arena *arena, sf_block *ptr, int index){
+    if(index != -1){
+        int quickLength = arena -> quickLists[index].length;
+        if(quickLength >= arena -> quickCapacity[index]){//make room, flushing part of the list if needed
+            quickLength = flushQuickList(arena, index);
+        }
+        quickLength++;
+        arena -> quickLists[index].length = quickLength;
+        arena -> stats.quickListBytes[index] += maskInfoBits(ptr -> header);
+        if(arena -> quickLists[index].first != NULL){
+            ptr -> header = (ptr -> header) | 0x4; //set the in quick list bit
+            ptr -> body.links.next = arena -> quickLists[index].first;
+            arena -> quickLists[index].first = ptr; 
+        }else{
+            ptr -> header = (ptr -> header) | 0x4; //set the in quick list bit
+            ptr -> body.links.next = NULL;
+            arena -> quickLists[index].first = ptr; 
+        }
+        return TRUE;
+    }else{
+        return FALSE; 
+    }
+}
+
+//returns true if the block was put into a quick list and returns false if it was not inserted into a quick list
+static int insertBlockIntoQuickList(sf_arena *arena, sf_block *ptr){
+    return insertBlockIntoQuickListAt(arena, ptr, getQuickListIndex(ptr -> header));
+}
+
+//Check that pp is the payload of a block allocated from the given arena
+static int validateArenaPointer(sf_arena *arena, void *pp){
+    if(pp == NULL){
+        return FALSE;
+    }
+
+    sf_block *block = (sf_block *) pp; 
+    block = incrementPointer(-sizeof(sf_header), block);
+    size_t size = maskInfoBits(block -> header); 
+
+    //sf_free checks pointers without the lock, so the bounds are read as published by initHeap and setEpilogue
+    if(!__atomic_load_n(&(arena -> mallocInit), __ATOMIC_ACQUIRE)){
+        return FALSE;
+    }
+    void *prologue = __atomic_load_n(&(arena -> heapProPtr), __ATOMIC_ACQUIRE);
+    void *epilogue = __atomic_load_n(&(arena -> heapEpiPtr), __ATOMIC_ACQUIRE);
+    if(pp < prologue + MIN_BLOCK_SIZE 
+        || ((uintptr_t) pp & (BLOCK_ALIGN - 1)) > 0 
+        || size < MIN_BLOCK_SIZE 
+        || (size & 0x7) > 0
+        || pp >= epilogue 
+        || getFooterPointer(block) >= epilogue 
+        || ((block -> header) & 0x4) > 0 //on a quick list or in a thread cache, freed already
+        || ((block -> header) & 0x1) == 0){
+            return FALSE;
+    }
+
+    if(((block -> header) & 0x2) == 0){ //get prev alloc bit
+        sf_block *prevHeader = getPrevBlock(pp);
+        if(((prevHeader -> header) & 0x1) < 0){
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+int validatePointer(void *pp){
+    return validateArenaPointer(&mainArena, pp);
+}
+
+//Return an allocated block to its arena, through the quick list at quickIndex unless it is -1
+static void freeBlockAt(sf_arena *arena, sf_block *block, int quickIndex){
+    //insert into quick list, flushing if neccessary first but done by function
+    if(insertBlockIntoQuickListAt(arena, block, quickIndex) == FALSE){
+        int prevAlloc = (block -> header) & 0x2; //extract prev alloc bit
+        size_t size = maskInfoBits(block -> header); //mask info bits so that we can make the header a free block not in quicklist
+        size = (size | (prevAlloc));//set the prev alloc bit if it was set in the header before
+        block -> header = size; 
+        sf_block *footer = getFooterPointer(block);
+        footer -> header = block -> header;  
+        insertBlockIntoFreeList(arena, block);
+    }
+}
+
+//Return an allocated block to its arena, through a quick list if its size has one
+static void freeBlock(sf_arena *arena, sf_block *block){
+    freeBlockAt(arena, block, getQuickListIndex(block -> header));
+}
+
+//Shrink the heap to just past the start of its last block when that block is free, giving the pages
+//after it back to the provider. returns the bytes the heap shrank by
+static size_t trimHeap(sf_arena *arena){
+    if(!arena -> mallocInit || ((arena -> heapEpiPtr -> header) & 0x2) > 0){//last block is allocated
+        return 0;
+    }
+    sf_block *last = getPrevBlock(arena -> heapEpiPtr);
+    size_t size = maskInfoBits(last -> header);
+    size_t bytes = (size - MIN_BLOCK_SIZE) / PAGE_SZ * PAGE_SZ;
+    if(bytes == 0){
+        return 0;
+    }
+
+    removeBlockFromFreeList(arena, last);
+    last -> header = (size - bytes) | ((last -> header) & 0x2);
+    sf_block *footer = getFooterPointer(last);
+    footer -> header = last -> header;
+    setEpilogue(arena, getNextBlock(last));
+    arena -> heapEpiPtr -> header = 0x1; //allocated block and prev alloc is always gonna be 0
+    markZeroBlock(last, arena -> takenZero);
+    insertBlockIntoFreeList(arena, last);
+
+    arena -> memEnd = incrementPointer(-bytes, arena -> memEnd);
+    arena -> stats.heapSize -= bytes;
+    //pages past the heap stay committed, so growing again only has to touch them. extendHeap counts on them
+    //reading as zero, so the parts of them that are not whole pages are cleared here
+    uintptr_t first = ((uintptr_t) arena -> memEnd + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+    uintptr_t end = (uintptr_t) arena -> committedEnd & ~(PAGE_SZ - 1);
+    if(end > first){
+        memset(arena -> memEnd, 0, first - (uintptr_t) arena -> memEnd);
+        arena -> provider -> decommit((void *) first, end - first);
+        memset((void *) end, 0, (uintptr_t) arena -> committedEnd - end);
+    }else{
+        memset(arena -> memEnd, 0, (uintptr_t) arena -> committedEnd - (uintptr_t) arena -> memEnd);
+    }
+    return bytes;
+}
+
+//Trim the heap and decommit the dirty pages of every free block. returns the bytes given back
+static size_t purgeArena(sf_arena *arena){
+    size_t released = trimHeap(arena);
+    if(arena == &mainArena){
+        released += purgeSlabRuns();
+    }
+    for(int i = getListIndex(PAGE_SZ); i < FREE_LIST_COUNT; i++){//smaller lists cannot hold a whole page
+        sf_block *head = &(arena -> freeListHeads[i]);
+        for(sf_block *block = head -> body.links.next; block != head; block = block -> body.links.next){
+            void *start;
+            size_t bytes = getPurgeableRange(block, &start);
+            if(bytes == 0 || *getPurgeMark(block) == ((uintptr_t) block ^ PURGE_MARK)){
+                continue;
+            }
+            arena -> provider -> decommit(start, bytes);
+            *getPurgeMark(block) = (uintptr_t) block ^ PURGE_MARK;
+            arena -> stats.dirtyBytes -= bytes;
+            arena -> stats.purgedBytes += bytes;
+            released += bytes;
+        }
+    }
+    arena -> dirtySince = 0;
+    return released;
+}
+
+static uint64_t clockMillis(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1; //+1 so the clock is never 0
+}
+
+//Called after blocks are freed: purge once the dirty bytes have stayed past the threshold for the decay time
+static void decayPurge(sf_arena *arena){
+    if(arena -> stats.dirtyBytes <= purgeThreshold){
+        arena -> dirtySince = 0;
+        return;
+    }
+    uint64_t now = clockMillis();
+    if(arena -> dirtySince == 0){
+        arena -> dirtySince = now;
+    }
+    if(now - arena -> dirtySince >= purgeDecay){
+        purgeArena(arena);
+    }
+}
+
+/*
+ * Sets when freed memory is given back automatically.  Once the whole pages inside free
+ * blocks of a heap add up to more than threshold bytes and stay above it for decay
+ * milliseconds, the next free gives them all back and trims the heap, as sf_trim does.
+ *
+ * @param threshold Dirty bytes a heap may keep, SIZE_MAX to never purge automatically.
+ * @param decay Milliseconds the dirty bytes may stay above the threshold, 0 to purge at once.
+ */
+void sf_set_purge(size_t threshold, unsigned long decay){
+    purgeThreshold = threshold;
+    purgeDecay = decay;
+}
+
+/*
+ * Gives freed memory of the heap behind sf_malloc back to its provider now: the heap
+ * shrinks to the start of its last block if that block is free, and the whole pages
+ * inside every other large free block are decommitted.
+ *
+ * @return The number of bytes given back.
+ */
+size_t sf_trim(){
+    LOCK_ARENA(&mainArena);
+    size_t released = purgeArena(&mainArena);
+    UNLOCK_ARENA(&mainArena);
+    return released;
+}
+
+/*
+ * Moves every block waiting in a quick list of the heap behind sf_malloc to the free
+ * lists, merging adjacent blocks.  This happens on its own before the heap grows.
+ *
+ * @return The number of blocks moved.
+ */
+size_t sf_consolidate(){
+    LOCK_ARENA(&mainArena);
+    size_t count = consolidateArena(&mainArena);
+    UNLOCK_ARENA(&mainArena);
+    return count;
+}
+
+//Check whether pp lies in a slab chunk. Chunks are only ever added, so this can run without the lock
+static int isSlabPointer(void *pp){
+    int n = __atomic_load_n(&numSlabChunks, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < n; i++){
+        if((char *) pp >= slabChunks[i].start && (char *) pp < slabChunks[i].end){
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void unlinkSlabRun(slab_run **list, slab_run *run){
+    if(run -> prev != NULL){
+        run -> prev -> next = run -> next;
+    }else{
+        *list = run -> next;
+    }
+    if(run -> next != NULL){
+        run -> next -> prev = run -> prev;
+    }
+}
+
+static void pushSlabRun(slab_run **list, slab_run *run){
+    run -> prev = NULL;
+    run -> next = *list;
+    if(*list != NULL){
+        (*list) -> prev = run;
+    }
+    *list = run;
+}
+
+//Get a page for a new run: an empty run, an unused page of the newest chunk, or a page of a new chunk
+//taken from the main heap. The chunk is a heap block with room to align its pages
+static slab_run *takeSlabPage(){
+    if(emptySlabRuns != NULL){
+        slab_run *run = emptySlabRuns;
+        unlinkSlabRun(&emptySlabRuns, run);
+        mainArena.stats.dirtyBytes -= PAGE_SZ;
+        return run;
+    }
+    if(numPurgedSlabPages > 0){
+        for(int i = 0; i < numSlabChunks; i++){
+            for(int word = 0; word < MAX_SLAB_CHUNK_PAGES / 64; word++){
+                if(purgedSlabPages[i][word] != 0){
+                    int bit = __builtin_ctzll(purgedSlabPages[i][word]);
+                    purgedSlabPages[i][word] &= ~((uint64_t) 1 << bit);
+                    numPurgedSlabPages--;
+                    mainArena.stats.purgedBytes -= PAGE_SZ;
+                    return (slab_run *) (slabChunks[i].start + (word * 64 + bit) * PAGE_SZ);
+                }
+            }
+        }
+    }
+    if(slabChunkEnd == slabChunkLimit){
+        if(numSlabChunks == MAX_SLAB_CHUNKS){
+            return NULL;
+        }
+        size_t pages = (size_t) MIN_SLAB_CHUNK_PAGES << numSlabChunks;
+        if(pages > MAX_SLAB_CHUNK_PAGES){
+            pages = MAX_SLAB_CHUNK_PAGES;
+        }
+        void *pp = mallocBlock(&mainArena, pages * PAGE_SZ + PAGE_SZ - sizeof(sf_header));
+        if(pp == NULL){
+            return NULL;
+        }
+        char *start = (char *) (((uintptr_t) pp + PAGE_SZ - 1) & ~(PAGE_SZ - 1));
+        mainArena.stats.slabBytes += maskInfoBits(((sf_block *) incrementPointer(-sizeof(sf_header), pp)) -> header);
+        slabChunks[numSlabChunks].start = start;
+        slabChunks[numSlabChunks].end = start + pages * PAGE_SZ;
+        __atomic_store_n(&numSlabChunks, numSlabChunks + 1, __ATOMIC_RELEASE);
+        slabChunkEnd = start;
+        slabChunkLimit = start + pages * PAGE_SZ;
+    }
+    slab_run *run = (slab_run *) slabChunkEnd;
+    slabChunkEnd += PAGE_SZ;
+    return run;
+}
+
+//Allocate a slot of the smallest class that holds size bytes, NULL if no page could be found for a new run
+static void *slabMalloc(size_t size){
+    int slabClass = (((size + BLOCK_ALIGN - 1) & ~(size_t) (BLOCK_ALIGN - 1)) >> 3) - 1;
+    slab_run *run = slabRuns[slabClass];
+    if(run == NULL){
+        run = takeSlabPage();
+        if(run == NULL){
+            return NULL;
+        }
+        run -> slotSize = (slabClass + 1) << 3;
+        run -> used = 0;
+        run -> numSlots = (PAGE_SZ - sizeof(slab_run)) / run -> slotSize;
+        for(int i = 0; i < SLAB_BITMAP_WORDS; i++){//mark the bits past the last slot as taken
+            size_t first = i * 64;
+            if(first + 64 <= run -> numSlots){
+                run -> bitmap[i] = 0;
+            }else if(first >= run -> numSlots){
+                run -> bitmap[i] = ~(uint64_t) 0;
+            }else{
+                run -> bitmap[i] = ~(uint64_t) 0 << (run -> numSlots - first);
+            }
+        }
+        pushSlabRun(&slabRuns[slabClass], run);
+    }
+
+    int word = 0;
+    while(run -> bitmap[word] == ~(uint64_t) 0){//a run on the list has a free slot
+        word++;
+    }
+    int bit = __builtin_ctzll(~run -> bitmap[word]);
+    run -> bitmap[word] |= (uint64_t) 1 << bit;
+    if(++run -> used == run -> numSlots){
+        unlinkSlabRun(&slabRuns[slabClass], run);
+    }
+    mainArena.stats.slabUsedBytes += run -> slotSize;
+    return run -> slots + (word * 64 + bit) * run -> slotSize;
+}
+
+//The run a slab pointer belongs to, and the slot's index in it. returns -1 if pp is not the start of an
+//allocated slot
+static long getSlabSlot(void *pp, slab_run **runPtr){
+    slab_run *run = (slab_run *) ((uintptr_t) pp & ~(PAGE_SZ - 1));
+    *runPtr = run;
+    if(run -> slotSize == 0 || (char *) pp < run -> slots){
+        return -1;
+    }
+    size_t offset = (char *) pp - run -> slots;
+    size_t index = offset / run -> slotSize;
+    if(offset % run -> slotSize != 0 || index >= run -> numSlots
+        || (run -> bitmap[index / 64] & ((uint64_t) 1 << (index % 64))) == 0){
+        return -1;
+    }
+    return index;
+}
+
+//Free a slab slot by clearing its bit, returns false if pp is not an allocated slot
+static int slabFree(void *pp){
+    slab_run *run;
+    long index = getSlabSlot(pp, &run);
+    if(index == -1){
+        return FALSE;
+    }
+    int slabClass = (run -> slotSize >> 3) - 1;
+    run -> bitmap[index / 64] &= ~((uint64_t) 1 << (index % 64));
+    mainArena.stats.slabUsedBytes -= run -> slotSize;
+    if(run -> used-- == run -> numSlots){//was full, so it is not on its class list
+        pushSlabRun(&slabRuns[slabClass], run);
+    }
+    if(run -> used == 0){
+        unlinkSlabRun(&slabRuns[slabClass], run);
+        run -> slotSize = 0;
+        pushSlabRun(&emptySlabRuns, run);
+        mainArena.stats.dirtyBytes += PAGE_SZ;
+    }
+    return TRUE;
+}
+
+//Give the pages of every empty slab run back to the main arena's provider. returns the bytes given back
+static size_t purgeSlabRuns(){
+    size_t released = 0;
+    while(emptySlabRuns != NULL){
+        slab_run *run = emptySlabRuns;
+        unlinkSlabRun(&emptySlabRuns, run);
+        int chunk = 0;
+        while((char *) run < slabChunks[chunk].start || (char *) run >= slabChunks[chunk].end){
+            chunk++;
+        }
+        size_t page = ((char *) run - slabChunks[chunk].start) / PAGE_SZ;
+        purgedSlabPages[chunk][page / 64] |= (uint64_t) 1 << (page % 64);
+        numPurgedSlabPages++;
+        mainArena.provider -> decommit(run, PAGE_SZ);
+        released += PAGE_SZ;
+    }
+    mainArena.stats.dirtyBytes -= released;
+    mainArena.stats.purgedBytes += released;
+    return released;
+}
+
+//Resize a slab slot, it stays put if the new size fits and otherwise moves to a larger slot or a block
+static void *reallocSlabSlot(void *pp, size_t rsize){
+    slab_run *run;
+    if(getSlabSlot(pp, &run) == -1){
+        setError(EINVAL);
+        return NULL;
+    }
+    if(rsize == 0){
+        slabFree(pp);
+        return NULL;
+    }
+    if(rsize <= run -> slotSize){
+        mainArena.stats.realloc.fitted++;
+        return pp;
+    }
+    void *larger = rsize <= slabMax ? slabMalloc(rsize) : NULL;
+    if(larger == NULL){
+        larger = rsize >= mmapThreshold ? mapBlock(rsize) : mallocBlock(&mainArena, rsize);
+    }
+    if(larger == NULL){ //sf_errno is set by mallocBlock or mapBlock
+        return NULL;
+    }
+    memcpy(larger, pp, run -> slotSize);
+    slabFree(pp);
+    return larger;
+}
+
+/*
+ * Sets the largest request sf_malloc serves from slabs instead of heap blocks.
+ *
+ * @param size At most 24, 0 to stop using slabs.  Slots already handed out stay valid.
+ *
+ * @return The previous value.
+ */
+size_t sf_set_slab_max(size_t size){
+    size_t old = slabMax;
+    slabMax = size < SLAB_LIMIT ? size : SLAB_LIMIT;
+    return old;
+}
+
+#ifdef SF_THREADS
+//Take the newest block off a thread cache list, clearing the tag pushThreadCache gave it
+static sf_block *popThreadCache(int index){
+    sf_block *ptr = threadCache[index].first;
+    threadCache[index].first = ptr -> body.links.next;
+    threadCache[index].length--;
+    __atomic_fetch_and(&(ptr -> header), ~(sf_header) 0x4, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+//Move the first n blocks of a thread cache list back to the main arena, its lock must be held
+static void drainThreadCache(int index, int n){
+    while(n > 0 && threadCache[index].first != NULL){
+        freeBlock(&mainArena, popThreadCache(index));
+        n--;
+    }
+}
+
+//Give this thread's whole cache back to the main arena, whose lock must be held, when a request finds the arena
+//out of memory. The cached blocks can then merge with their neighbours for a retry. returns false if the cache
+//was empty and a retry would fail again
+static int reclaimThreadCache(){
+    int reclaimed = FALSE;
+    for(int i = 0; i < NUM_QUICK_LISTS; i++){
+        reclaimed = reclaimed || threadCache[i].length > 0;
+        drainThreadCache(i, threadCache[i].length);
+    }
+    if(reclaimed){
+        sf_errno = 0; //the failed attempt set it, the retry sets it again if it also fails
+    }
+    return reclaimed;
+}
+
+//pthread key destructor, returns everything a finished thread still has cached to the main arena. Another key's
+//destructor may still allocate or free afterwards, which then goes straight to the arena, as nothing would
+//drain the cache again
+static void releaseThreadCache(void *unused){
+    threadCacheReleased = TRUE;
+    LOCK_ARENA(&mainArena);
+    for(int i = 0; i < NUM_QUICK_LISTS; i++){
+        drainThreadCache(i, threadCache[i].length);
+    }
+    UNLOCK_ARENA(&mainArena);
+}
+
+static void createThreadCacheKey(){
+    pthread_key_create(&threadCacheKey, releaseThreadCache);
+}
+
+//Arrange for this thread's cache to be drained when the thread exits
+static void registerThreadCache(){
+    if(!threadCacheRegistered){
+        //set first: pthread_setspecific may allocate, which must not come back here
+        threadCacheRegistered = TRUE;
+        pthread_once(&threadCacheKeyOnce, createThreadCacheKey);
+        pthread_setspecific(threadCacheKey, &threadCacheRegistered);
+    }
+}
+
+#ifdef SF_PRELOAD
+//A process that forks while another thread holds the main arena's lock would leave the child with a lock no
+//thread there can release, so libsfmm.so holds the lock across fork. The child keeps only the forking thread,
+//blocks cached by the others stay allocated
+static void lockBeforeFork(){
+    LOCK_ARENA(&mainArena);
+}
+
+static void unlockAfterFork(){
+    UNLOCK_ARENA(&mainArena);
+}
+
+static void resetAfterFork(){
+    pthread_mutex_init(&(mainArena.lock), NULL);
+}
+
+__attribute__((constructor)) static void registerForkHandlers(){
+    pthread_atfork(lockBeforeFork, unlockAfterFork, resetAfterFork);
+}
+#endif
+
+//Push an allocated block onto a thread cache list, tagged with the in quick list bit so that validatePointer
+//turns down a second free of it from any thread. The thread holding the arena lock may update the block's prev
+//alloc bit at any time, so the tag is set atomically, see setPrevAlloc
+static void pushThreadCache(int index, sf_block *ptr){
+    __atomic_fetch_or(&(ptr -> header), 0x4, __ATOMIC_RELAXED);
+    ptr -> body.links.next = threadCache[index].first;
+    threadCache[index].first = ptr;
+    threadCache[index].length++;
+}
+
+//Serve a small request from this thread's cache, refilling the cache with a batch of blocks under
+//one acquisition of the main arena's lock when it is empty. Returns null if the size is too big to be cached
+//or the cache has been released.
+static void *threadCacheMalloc(size_t size){
+    int index = getQuickListIndex(getRequiredBlockSize(size));
+    if(index == -1 || threadCacheReleased){
+        return NULL;
+    }
+    if(threadCache[index].length == 0){
+        registerThreadCache();
+        LOCK_ARENA(&mainArena);
+        for(int i = 0; i < THREAD_CACHE_BATCH; i++){
+            void *pp = mallocBlock(&mainArena, size);
+            if(pp == NULL){
+                break;
+            }
+            pushThreadCache(index, incrementPointer(-sizeof(sf_header), pp));
+        }
+        UNLOCK_ARENA(&mainArena);
+        if(threadCache[index].length == 0){
+            return NULL;
+        }
+    }
+    return popThreadCache(index) -> body.payload;
+}
+
+//Put a freed block in this thread's cache (index is its quick list index), draining a batch to the main
+//arena when the cache is full. returns false if the block is too big to be cached or the cache has been released
+static int threadCacheFree(sf_block *block, int index){
+    if(index == -1 || threadCacheReleased){
+        return FALSE;
+    }
+    registerThreadCache();
+    if(threadCache[index].length == THREAD_CACHE_MAX){
+        LOCK_ARENA(&mainArena);
+        drainThreadCache(index, THREAD_CACHE_BATCH);
+        UNLOCK_ARENA(&mainArena);
+    }
+    pushThreadCache(index, block);
+    return TRUE;
+}
+#endif
+
+#ifdef SF_TRACE
+static uint64_t traceClock(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+//Write out all buffered records, recording stops for good if the file cannot be written
+static void writeTraceBuffer(){
+    char *bytes = (char *) traceBuffer;
+    size_t remaining = traceLength * sizeof(sf_trace_record);
+    while(remaining > 0){
+        ssize_t written = write(traceFd, bytes, remaining);
+        if(written < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            close(traceFd);
+            traceState = -1;
+            break;
+        }
+        bytes += written;
+        remaining -= written;
+    }
+    traceLength = 0;
+}
+
+static void closeTrace(){
+    LOCK_TRACE();
+    if(traceState > 0){
+        writeTraceBuffer();
+        close(traceFd);
+        traceState = -1;
+    }
+    UNLOCK_TRACE();
+}
+
+//Start recording if SF_TRACE_FILE is set, called with the trace lock held on the first traced call
+static void openTrace(){
+    traceState = -1;
+    const char *path = getenv("SF_TRACE_FILE");
+    if(path == NULL || *path == '\0'){
+        return;
+    }
+    int savedErrno = errno;
+    traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(traceFd >= 0){
+        sf_trace_header header = {SF_TRACE_MAGIC, sizeof(sf_trace_record), 0};
+        if(write(traceFd, &header, sizeof(header)) == sizeof(header)){
+            traceStart = traceClock();
+            traceState = 1;
+            atexit(closeTrace);
+        }else{
+            close(traceFd);
+        }
+    }
+    errno = savedErrno;
+}
+
+static void traceRecord(int op, void *ptr, void *result, size_t size, size_t align){
+    LOCK_TRACE();
+    if(traceState == 0){
+        openTrace();
+    }
+    if(traceState > 0){
+        if(traceLength == TRACE_BUFFER_RECORDS){
+            writeTraceBuffer();
+        }
+        sf_trace_record *record = &traceBuffer[traceLength++];
+        record -> timestamp = traceClock() - traceStart;
+        record -> ptr = (uintptr_t) ptr;
+        record -> result = (uintptr_t) result;
+        record -> size = size;
+        record -> align = align;
+        record -> op = op;
+    }
+    UNLOCK_TRACE();
+}
+#endif
+
+/*
+ * Writes any buffered trace records to $SF_TRACE_FILE.  Does nothing unless sfmm was
+ * built with SF_TRACE and recording is on.  Buffered records are also written at exit.
+ */
+void sf_trace_flush(){
+#ifdef SF_TRACE
+    LOCK_TRACE();
+    if(traceState > 0){
+        writeTraceBuffer();
+    }
+    UNLOCK_TRACE();
+#endif
+}
+
+/*
+ * Returns the latency histograms and counters recorded so far.  All zero unless sfmm was
+ * built with SF_PROFILE.
+ */
+sf_profile sf_profile_stats(){
+#ifdef SF_PROFILE
+    return profile;
+#else
+    sf_profile empty = {0};
+    return empty;
+#endif
+}
+
+/*
+ * Clears the latency histograms and counters, for instance after a warm-up phase.  Calls
+ * running at the same time may be partly counted.
+ */
+void sf_profile_reset(){
+#ifdef SF_PROFILE
+    memset(&profile, 0, sizeof(profile));
+#endif
+}
+
+//Approximate percentile of a histogram: the upper bound of the bucket the pct'th percent event falls in
+static uint64_t getPercentile(const sf_histogram *histogram, int pct){
+    uint64_t rank = (histogram -> count * pct + 99) / 100;
+    uint64_t seen = 0;
+    for(int i = 0; i < SF_PROFILE_BUCKETS; i++){
+        seen += histogram -> buckets[i];
+        if(seen >= rank){
+            return i == 0 ? 0 : ((uint64_t) 1 << i) - 1;
+        }
+    }
+    return UINT64_MAX;
+}
+
+/*
+ * Writes a report of the latency histograms and counters: count, mean and approximate
+ * percentiles of every histogram and the coalesce cases.
+ *
+ * @param out Where the report goes.
+ */
+void sf_profile_dump(FILE *out){
+    sf_profile stats = sf_profile_stats();
+    struct {
+        const char *name;
+        const sf_histogram *histogram;
+    } rows[] = {
+        {"malloc", &stats.mallocLatency}, {"calloc", &stats.callocLatency}, {"free", &stats.freeLatency},
+        {"realloc", &stats.reallocLatency}, {"memalign", &stats.memalignLatency},
+        {"quick list hit", &stats.quickListHit}, {"free list search", &stats.freeListSearch},
+        {"coalesce", &stats.coalesce}, {"extend heap", &stats.extendHeap}, {"consolidate", &stats.consolidate},
+        {"nodes visited", &stats.nodesVisited},
+    };
+    fprintf(out, "%-18s %12s %10s %10s %10s %10s\n", "ticks", "count", "mean", "p50", "p90", "p99");
+    for(size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++){
+        const sf_histogram *histogram = rows[i].histogram;
+        fprintf(out, "%-18s %12" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", rows[i].name,
+            histogram -> count, histogram -> count == 0 ? 0 : histogram -> total / histogram -> count,
+            getPercentile(histogram, 50), getPercentile(histogram, 90), getPercentile(histogram, 99));
+    }
+    fprintf(out, "coalesce cases: bothFree %" PRIu64 " prevFree %" PRIu64 " nextFree %" PRIu64 " bothAlloc %" PRIu64 "\n",
+        stats.coalesceCases[0], stats.coalesceCases[1], stats.coalesceCases[2], stats.coalesceCases[3]);
+}
+
+/*
+ * This is your implementation of sf_malloc. It acquires uninitialized memory that
+ * is aligned and padded properly for the underlying system.
+ *
+ * @param size The number of bytes requested to be allocated.
+ *
+ * @return If size is 0, then NULL is returned without setting sf_errno.
+ * If size is nonzero, then if the allocation is successful a pointer to a valid region of
+ * memory of the requested size is returned.  If the allocation is not successful, then
+ * NULL is returned and sf_errno is set to ENOMEM.
+ */
+void *sf_malloc(size_t size) {
+    if(size == 0)
+        return NULL;
+    PROFILE_START();
+
+    COUNT_CALLS(&mainArena, mallocCalls, 1);
+    if(size >= mmapThreshold){
+        void *mapped = mapBlock(size);
+        if(mapped == NULL){
+            COUNT_CALLS(&mainArena, mallocFailures, 1);
+        }
+        TRACE(SF_TRACE_MALLOC, NULL, mapped, size, 0);
+        PROFILE_END(mallocLatency);
+        return mapped;
+    }
+    if(size <= slabMax){
+        LOCK_ARENA(&mainArena);
+        void *slot = slabMalloc(size);
+        UNLOCK_ARENA(&mainArena);
+        if(slot != NULL){
+            TRACE(SF_TRACE_MALLOC, NULL, slot, size, 0);
+            PROFILE_END(mallocLatency);
+            return slot;
+        }
+    }
+#ifdef SF_THREADS
+    void *cached = threadCacheMalloc(size);
+    if(cached != NULL){
+        TRACE(SF_TRACE_MALLOC, NULL, cached, size, 0);
+        PROFILE_END(mallocLatency);
+        return cached;
+    }
+#endif
+    LOCK_ARENA(&mainArena);
+    void *pp = mallocBlock(&mainArena, size);
+#ifdef SF_THREADS
+    if(pp == NULL && reclaimThreadCache()){
+        pp = mallocBlock(&mainArena, size);
+    }
+#endif
+    if(pp == NULL){
+        mainArena.stats.mallocFailures++;
+    }
+    UNLOCK_ARENA(&mainArena);
+    TRACE(SF_TRACE_MALLOC, NULL, pp, size, 0);
+    PROFILE_END(mallocLatency);
+    return pp;
+}
+
+/*
+ * Allocates an array of nmemb elements of size bytes each with every byte set to zero.
+ * Only the bytes not already known to be zero are cleared: pages the heap has just grown
+ * by or has purged, and mappings for large requests, read as zero without any work.
+ *
+ * @param nmemb The number of elements.
+ * @param size The size of each element in bytes.
+ * @return A pointer to the zeroed memory, or NULL if nmemb or size is 0.  If nmemb * size
+ * overflows or the allocation is not successful, NULL is returned and sf_errno is set to
+ * ENOMEM.
+ */
+void *sf_calloc(size_t nmemb, size_t size){
+    size_t total;
+    if(__builtin_mul_overflow(nmemb, size, &total)){
+        COUNT_CALLS(&mainArena, mallocCalls, 1);
+        COUNT_CALLS(&mainArena, mallocFailures, 1);
+        return malloc_err();
+    }
+    if(total == 0)
+        return NULL;
+    PROFILE_START();
+
+    COUNT_CALLS(&mainArena, mallocCalls, 1);
+    if(total >= mmapThreshold){//a fresh mapping is already zero
+        void *mapped = mapBlock(total);
+        if(mapped == NULL){
+            COUNT_CALLS(&mainArena, mallocFailures, 1);
+        }
+        TRACE(SF_TRACE_MALLOC, NULL, mapped, total, 0);
+        PROFILE_END(callocLatency);
+        return mapped;
+    }
+    if(total <= slabMax){
+        LOCK_ARENA(&mainArena);
+        void *slot = slabMalloc(total);
+        UNLOCK_ARENA(&mainArena);
+        if(slot != NULL){
+            memset(slot, 0, total);
+            TRACE(SF_TRACE_MALLOC, NULL, slot, total, 0);
+            PROFILE_END(callocLatency);
+            return slot;
+        }
+    }
+#ifdef SF_THREADS
+    void *cached = threadCacheMalloc(total);
+    if(cached != NULL){
+        memset(cached, 0, total);
+        TRACE(SF_TRACE_MALLOC, NULL, cached, total, 0);
+        PROFILE_END(callocLatency);
+        return cached;
+    }
+#endif
+    LOCK_ARENA(&mainArena);
+    void *pp = callocBlock(&mainArena, total);
+#ifdef SF_THREADS
+    if(pp == NULL && reclaimThreadCache()){
+        pp = callocBlock(&mainArena, total);
+    }
+#endif
+    if(pp == NULL){
+        mainArena.stats.mallocFailures++;
+    }
+    UNLOCK_ARENA(&mainArena);
+    TRACE(SF_TRACE_MALLOC, NULL, pp, total, 0);
+    PROFILE_END(callocLatency);
+    return pp;
+}
+
+/*
  * Marks a dynamically allocated region as no longer in use.
  * Adds the newly freed block to the free list.
  *
  * @param ptr Address of memory returned by the function sf_malloc.
- *
- * If ptr is invalid, the function calls abort() to exit the program.
+ *
+ * If ptr is invalid, the function calls abort() to exit the program.
+ */
+void sf_free(void *pp) {
+    PROFILE_START();
+    sf_block *block = (sf_block *) pp; 
+    block = incrementPointer(-sizeof(sf_header), block);
+
+    if(isSlabPointer(pp)){
+        TRACE(SF_TRACE_FREE, pp, NULL, 0, 0);
+        COUNT_CALLS(&mainArena, freeCalls, 1);
+        LOCK_ARENA(&mainArena);
+        int freed = slabFree(pp);
+        if(freed){
+            decayPurge(&mainArena);
+        }
+        UNLOCK_ARENA(&mainArena);
+        if(!freed){
+            abort();
+        }
+        PROFILE_END(freeLatency);
+        return;
+    }
+    if(isMappedBlock(pp)){
+        TRACE(SF_TRACE_FREE, pp, NULL, 0, 0);
+        COUNT_CALLS(&mainArena, freeCalls, 1);
+        unmapBlock(pp);
+        PROFILE_END(freeLatency);
+        return;
+    }
+    if(!validatePointer(pp)){
+        abort();
+    }
+
+    //record frees before the block can be handed out again so the trace never shows an address twice
+    TRACE(SF_TRACE_FREE, pp, NULL, 0, 0);
+    COUNT_CALLS(&mainArena, freeCalls, 1);
+#ifdef SF_THREADS
+    if(threadCacheFree(block, getQuickListIndex(block -> header)) == TRUE){
+        PROFILE_END(freeLatency);
+        return;
+    }
+#endif
+    LOCK_ARENA(&mainArena);
+    freeBlock(&mainArena, block);
+    decayPurge(&mainArena);
+    UNLOCK_ARENA(&mainArena);
+    PROFILE_END(freeLatency);
+}
+
+//Carve up to n blocks of blockSize, in one pass, from the front of a free block that has already been
+//unlinked, storing their payloads in out. The last block absorbs a leftover too small to split off.
+//returns the number of blocks carved
+static size_t carveBlocks(sf_arena *arena, sf_block *ptr, size_t blockSize, size_t n, void **out){
+    size_t freeBlockSize = maskInfoBits(ptr -> header);
+    size_t count = freeBlockSize / blockSize;
+    if(count > n){
+        count = n;
+    }
+    size_t leftover = freeBlockSize - count * blockSize;
+    int prevAlloc = (ptr -> header) & 0x2;
+    sf_block *cursor = ptr;
+    for(size_t i = 0; i < count; i++){
+        size_t size = blockSize;
+        if(i == count - 1 && leftover < MIN_BLOCK_SIZE){
+            size += leftover; //do not leave a splinter behind
+        }
+        cursor -> header = size | prevAlloc | 0x1;
+        out[i] = cursor -> body.payload;
+        prevAlloc = 0x2; //every block after the first follows one we just allocated
+        cursor = incrementPointer(size, cursor);
+    }
+    if(leftover >= MIN_BLOCK_SIZE){
+        cursor -> header = leftover | 0x2;
+        sf_block *footer = getFooterPointer(cursor);
+        footer -> header = cursor -> header;
+        insertBlockIntoFreeList(arena, cursor);
+    }else{
+        setPrevAlloc(cursor, TRUE); //cursor is the block after the last one carved
+        countSplinter(arena, leftover);
+    }
+    return count;
+}
+
+//Allocate n blocks for the same payload size, the arena lock must be held. Blocks come from the matching
+//quick list first, then are carved from as few free blocks as possible. returns the number allocated
+static size_t mallocBatch(sf_arena *arena, size_t size, size_t n, void **out){
+    if(!arena -> mallocInit && initHeap(arena) == FALSE){
+        malloc_err();
+        return 0;
+    }
+
+    size_t blockSize = getRequiredBlockSize(size);
+    size_t count = 0;
+    int quickIndex = getQuickListIndex(blockSize);
+    while(quickIndex != -1 && count < n && arena -> quickLists[quickIndex].length != 0){
+        sf_block *ptr = arena -> quickLists[quickIndex].first;
+        arena -> quickLists[quickIndex].first = ptr -> body.links.next;
+        arena -> quickLists[quickIndex].length--;
+        arena -> stats.quickListBytes[quickIndex] -= blockSize;
+        arena -> stats.quickListHits[quickIndex]++;
+        ptr -> header = (ptr -> header) & ~0x4; //block is no longer in a quick list
+        out[count++] = ptr -> body.payload;
+    }
+    if(quickIndex != -1 && count < n){
+        countQuickListMiss(arena, quickIndex);
+    }
+
+    while(count < n){
+        //prefer one free block that holds everything that is left, otherwise carve whatever fits
+        size_t remaining = n - count;
+        sf_block *ptr = NULL;
+        if(remaining <= SIZE_MAX / blockSize){
+            ptr = takeFreeBlock(arena, remaining * blockSize);
+        }
+        if(ptr == NULL){
+            ptr = takeFreeBlock(arena, blockSize);
+        }
+        if(ptr == NULL){
+            if(consolidateArena(arena) == 0
+                && extendHeap(arena, remaining <= SIZE_MAX / blockSize ? remaining * blockSize : blockSize) == FALSE){
+                malloc_err();
+                break;
+            }
+            continue;
+        }
+        count += carveBlocks(arena, ptr, blockSize, remaining, out + count);
+    }
+    return count;
+}
+
+//Free a batch of pointers, the arena lock must be held. The pointers are sorted by address so that each
+//run of adjacent blocks is merged and handed to insertBlockIntoFreeList once. Single blocks go through
+//freeBlock as usual. Aborts before freeing anything if a pointer is invalid or repeated.
+//returns the number of blocks freed
+static size_t freeBatch(sf_arena *arena, void **ptrs, size_t n){
+    sortAddresses(ptrs, n);
+    size_t first = 0;
+    while(first < n && ptrs[first] == NULL){//nulls sort to the front and are skipped
+        first++;
+    }
+    for(size_t i = first; i < n; i++){
+        slab_run *run;
+        int valid = isSlabPointer(ptrs[i]) ? getSlabSlot(ptrs[i], &run) != -1
+            : isMappedBlock(ptrs[i]) || validateArenaPointer(arena, ptrs[i]);
+        if(!valid || (i > first && ptrs[i] == ptrs[i - 1])){
+            abort();
+        }
+    }
+
+    size_t i = first;
+    while(i < n){
+        if(isSlabPointer(ptrs[i])){
+            slabFree(ptrs[i++]);
+            continue;
+        }
+        if(isMappedBlock(ptrs[i])){
+            unmapBlock(ptrs[i++]);
+            continue;
+        }
+        sf_block *start = (sf_block *) incrementPointer(-sizeof(sf_header), ptrs[i]);
+        sf_block *end = getNextBlock(start);
+        size_t j = i + 1;
+        while(j < n && incrementPointer(-sizeof(sf_header), ptrs[j]) == (void *) end){
+            end = getNextBlock(end);
+            j++;
+        }
+        if(j - i == 1){
+            freeBlock(arena, start);
+        }else{
+            size_t size = (uintptr_t) end - (uintptr_t) start;
+            start -> header = size | ((start -> header) & 0x2);
+            sf_block *footer = getFooterPointer(start);
+            footer -> header = start -> header;
+            insertBlockIntoFreeList(arena, start);
+        }
+        i = j;
+    }
+    return n - first;
+}
+
+/*
+ * Same as sf_free, for a caller that knows the size it passed to sf_malloc (like C++ sized
+ * delete).  The pointer is not validated, except in the debug build, which also checks that
+ * size matches the block, so passing a wrong pointer or size is undefined behavior.
+ *
+ * @param ptr Address of memory returned by the function sf_malloc.
+ * @param size The size that was requested when ptr was allocated.
  */
-void sf_free(void *pp) {
-    sf_block *block = (sf_block *) pp; 
-    block = incrementPointer(-sizeof(sf_header), block);
+void sf_free_sized(void *pp, size_t size){
+    if(isMappedBlock(pp) || isSlabPointer(pp)){
+        sf_free(pp);
+        return;
+    }
+    sf_block *block = (sf_block *) incrementPointer(-sizeof(sf_header), pp);
+    PROFILE_START();
 
-    if(!validatePointer(pp)){
+#ifdef DEBUG
+    size_t blockSize = getRequiredBlockSize(size);
+    size_t actualSize = maskInfoBits(block -> header);
+    if(!validatePointer(pp) || actualSize < blockSize || actualSize - blockSize >= MIN_BLOCK_SIZE){
+        error("sf_free_sized: %p is not a block allocated for %zu bytes", pp, size);
         abort();
     }
+#endif
 
-    //insert into quick list, flushing if neccessary first but done by function
-    if(insertBlockIntoQuickList(block) == FALSE){
-        int prevAlloc = (block -> header) & 0x2; //extract prev alloc bit
-        size_t size = maskInfoBits(block -> header); //mask info bits so that we can make the header a free block not in quicklist
-        size = (size | (prevAlloc));//set the prev alloc bit if it was set in the header before
-        block -> header = size; 
-        sf_block *footer = getFooterPointer(block);
-        footer -> header = block -> header;  
-        insertBlockIntoFreeList(block);
+    int quickIndex = getQuickListIndex(block -> header);
+
+    TRACE(SF_TRACE_FREE, pp, NULL, 0, 0);
+    COUNT_CALLS(&mainArena, freeCalls, 1);
+#ifdef SF_THREADS
+    if(threadCacheFree(block, quickIndex) == TRUE){
+        PROFILE_END(freeLatency);
+        return;
     }
+#endif
+    LOCK_ARENA(&mainArena);
+    freeBlockAt(&mainArena, block, quickIndex);
+    decayPurge(&mainArena);
+    UNLOCK_ARENA(&mainArena);
+    PROFILE_END(freeLatency);
 }
 
-/*
- * Resizes the memory pointed to by ptr to size bytes.
- *
- * @param ptr Address of the memory region to resize.
- * @param size The minimum size to resize the memory to.
- *
- * @return If successful, the pointer to a valid region of memory is
- * returned, else NULL is returned and sf_errno is set appropriately.
- *
- *   If sf_realloc is called with an invalid pointer sf_errno should be set to EINVAL.
- *   If there is no memory available sf_realloc should set sf_errno to ENOMEM.
- *
- * If sf_realloc is called with a valid pointer and a size of 0 it should free
- * the allocated block and return NULL without setting sf_errno.
- */
+//Grow an allocated block to newSize without moving it, either by absorbing the free block after it
+//or, when the block is the last one before the epilogue, by extending the heap.
+//returns false if the block cannot be grown in place
+static int growBlockInPlace(sf_arena *arena, sf_block *block, size_t newSize){
+    size_t size = maskInfoBits(block -> header);
+    sf_block *next = getNextBlock(block);
+    int nextFree = ((next -> header) & 0x1) == 0;
+    size_t available = size + (nextFree ? maskInfoBits(next -> header) : 0);
+    int grewHeap = FALSE;
+    if(available < newSize){
+        //only a block that is last in the heap, or followed by the last free block, can grow with the heap
+        if(next != arena -> heapEpiPtr && !(nextFree && getNextBlock(next) == arena -> heapEpiPtr)){
+            return FALSE;
+        }
+        while(available < newSize){
+            if(extendHeap(arena, newSize - size) == FALSE){
+                return FALSE;
+            }
+            next = getNextBlock(block); //new pages were coalesced into one free block right after ours
+            available = size + maskInfoBits(next -> header);
+        }
+        grewHeap = TRUE;
+    }
 
-void *sf_realloc(void *pp, size_t rsize) {
+    removeBlockFromFreeList(arena, next);
+    (next -> header) &= 0x0; //clear header to make space for payload
+    block -> header = available | ((block -> header) & 0x7);
+    splitBlock(arena, available, newSize, block, arena -> takenZero);
+    setPrevAlloc(getNextBlock(block), TRUE);
+    if(grewHeap){
+        arena -> stats.realloc.grownHeap++;
+    }else{
+        arena -> stats.realloc.grownIntoNext++;
+    }
+    return TRUE;
+}
+
+//Resize an allocated block as described for sf_realloc, the arena lock must be held
+static void *reallocBlock(sf_arena *arena, void *pp, size_t rsize){
     sf_block *block = (sf_block *) incrementPointer(-sizeof(sf_header), pp);
 
-    if(!validatePointer(pp)){
-        sf_errno = EINVAL;
+    if(!validateArenaPointer(arena, pp)){
+        setError(EINVAL);
         return NULL;
     }
 
@@ -493,60 +2575,368 @@ void *sf_realloc(void *pp, size_t rsize) {
         block -> header = size;
         sf_block *footer = getFooterPointer(block);
         footer -> header = size;
-        insertBlockIntoFreeList(block);
+        insertBlockIntoFreeList(arena, block);
         return NULL; 
     }
 
     size_t size = maskInfoBits(block -> header);
-    if(size < rsize){//realloc to a larger size
-        void *largerBlock = sf_malloc(rsize);
-        if(largerBlock == NULL){ //sf_errno is set sf_malloc
+    size_t newSize = getRequiredBlockSize(rsize);
+    if(newSize <= size && size - newSize < MIN_BLOCK_SIZE){//fits, and too little would be left to split off
+        //the slack is not counted again: what was counted when the block was handed out is not known here, so
+        //slack a shrink leaves in a block that fit exactly is missed, see sf_heap_stats.splinterAllocBytes
+        arena -> stats.realloc.fitted++;
+        return pp;
+    }
+    if(size < newSize){//realloc to a larger size
+        if(growBlockInPlace(arena, block, newSize) == TRUE){
+            return pp;
+        }
+        void *largerBlock;
+        if(arena == &mainArena && rsize >= mmapThreshold){
+            largerBlock = mapBlock(rsize);
+        }else{
+            largerBlock = mallocBlock(arena, rsize);
+        }
+        if(largerBlock == NULL){ //sf_errno is set by mallocBlock or mapBlock
             return NULL;
         }
         size_t payloadSize = maskInfoBits(block -> header) - sizeof(sf_header);
         memcpy(largerBlock, pp, payloadSize);
         //free prev block
-        sf_free(pp);
+        freeBlock(arena, block);
+        arena -> stats.realloc.moved++;
         return largerBlock;
-    }else if(size == rsize){//realloc of same size so just return current pointer
-        return pp;
-    }else{//realloc to a smaller size
-        size_t newSize = rsize + sizeof(sf_header); //allocated blocks consists of header and payload
-        if(newSize < MIN_BLOCK_SIZE){
-            newSize = MIN_BLOCK_SIZE;
-        }else{
-            while((newSize & 0x7) > 0){ //make size a multiple 8 if not
-                newSize++;
-            }
+    }else{//realloc to a smaller size, splitting off the rest
+        arena -> stats.realloc.shrunk++;
+        sf_block *newBlock = incrementPointer(newSize, block);
+        newBlock -> header = (size - newSize) | 0x2; //prev alloc bit is true
+        sf_block *footer = getFooterPointer(newBlock);
+        footer -> header = newBlock -> header;
+        block -> header = (block -> header) - maskInfoBits(newBlock -> header);
+        insertBlockIntoFreeList(arena, newBlock); //insert new free block into free list
+        return block -> body.payload;
+    }
+}
+
+/*
+ * Allocates n blocks that can each hold size bytes, with a single size computation and
+ * quick list lookup, carving the blocks from as few free blocks as possible.
+ *
+ * @param size The number of bytes requested for each block.
+ * @param n The number of blocks requested.
+ * @param out Array of at least n entries that receives the payload pointers.
+ *
+ * @return The number of blocks allocated, which are stored at the front of out.  If fewer
+ * than n could be allocated, the remaining entries of out are set to NULL and sf_errno is
+ * set to ENOMEM.  If size is 0, every entry is set to NULL and 0 is returned without
+ * setting sf_errno.
+ */
+size_t sf_malloc_batch(size_t size, size_t n, void **out){
+    size_t count = 0;
+    if(size != 0){
+        COUNT_CALLS(&mainArena, mallocCalls, n);
+        LOCK_ARENA(&mainArena);
+        count = mallocBatch(&mainArena, size, n, out);
+        if(count < n){
+            mainArena.stats.mallocFailures += n - count;
         }
+        UNLOCK_ARENA(&mainArena);
+    }
+    for(size_t i = count; i < n; i++){
+        out[i] = NULL;
+    }
+#ifdef SF_TRACE
+    for(size_t i = 0; i < n; i++){
+        TRACE(SF_TRACE_MALLOC, NULL, out[i], size, 0);
+    }
+#endif
+    return count;
+}
 
-        if(maskInfoBits(block -> header) - newSize >= MIN_BLOCK_SIZE){//only split if not creating splinter
-            sf_block *newBlock = incrementPointer(newSize, block);
-            newBlock -> header = (maskInfoBits(block -> header) - newSize) | 0x2; //prev alloc bit is true
-            sf_block *footer = getFooterPointer(newBlock);
-            footer -> header = newBlock -> header;
-            block -> header = (block -> header) - maskInfoBits(newBlock -> header);
-            insertBlockIntoFreeList(newBlock); //insert new free block into free list
-            return block -> body.payload;
-        }else{//cannot split block so just return orig pointer
-            return pp;
+/*
+ * Frees n blocks at once.  Runs of blocks that are adjacent in the heap are coalesced
+ * together before being added to the free lists.
+ *
+ * @param ptrs Addresses returned by sf_malloc and friends.  NULL entries are skipped.
+ * The array is sorted by address in place.
+ * @param n The number of entries in ptrs.
+ *
+ * If any pointer is invalid or appears twice, the function calls abort() before freeing anything.
+ */
+void sf_free_batch(void **ptrs, size_t n){
+#ifdef SF_TRACE
+    for(size_t i = 0; i < n; i++){
+        if(ptrs[i] != NULL){
+            TRACE(SF_TRACE_FREE, ptrs[i], NULL, 0, 0);
         }
     }
+#endif
+    LOCK_ARENA(&mainArena);
+    size_t count = freeBatch(&mainArena, ptrs, n);
+    decayPurge(&mainArena);
+    UNLOCK_ARENA(&mainArena);
+    COUNT_CALLS(&mainArena, freeCalls, count);
 }
 
-static int isPowerOf2(int n){
-    if(n < 1){
-        return FALSE; 
+/*
+ * Resizes the memory pointed to by ptr to size bytes.
+ *
+ * @param ptr Address of the memory region to resize.
+ * @param size The minimum size to resize the memory to.
+ *
+ * @return If successful, the pointer to a valid region of memory is
+ * returned, else NULL is returned and sf_errno is set appropriately.
+ *
+ *   If sf_realloc is called with an invalid pointer sf_errno should be set to EINVAL.
+ *   If there is no memory available sf_realloc should set sf_errno to ENOMEM.
+ *
+ * If sf_realloc is called with a valid pointer and a size of 0 it should free
+ * the allocated block and return NULL without setting sf_errno.
+ *
+ * A size of at most sf_malloc_usable_size(ptr) returns ptr as it is, unless the
+ * block would have enough to spare to give back, so that a caller can grow into
+ * the slack without copying.
+ */
+void *sf_realloc(void *pp, size_t rsize) {
+    PROFILE_START();
+    COUNT_CALLS(&mainArena, reallocCalls, 1);
+    void *result;
+    if(isMappedBlock(pp)){
+        result = reallocMappedBlock(pp, rsize);
+        if(result == NULL && rsize != 0){
+            COUNT_CALLS(&mainArena, reallocFailures, 1);
+        }
+    }else{
+        LOCK_ARENA(&mainArena);
+        result = isSlabPointer(pp) ? reallocSlabSlot(pp, rsize) : reallocBlock(&mainArena, pp, rsize);
+#ifdef SF_THREADS
+        if(result == NULL && rsize != 0 && sf_errno == ENOMEM && reclaimThreadCache()){
+            result = isSlabPointer(pp) ? reallocSlabSlot(pp, rsize) : reallocBlock(&mainArena, pp, rsize);
+        }
+#endif
+        if(result == NULL && rsize != 0){
+            mainArena.stats.reallocFailures++;
+        }
+        UNLOCK_ARENA(&mainArena);
     }
+    TRACE(SF_TRACE_REALLOC, pp, result, rsize, 0);
+    PROFILE_END(reallocLatency);
+    return result;
+}
 
-    while(n != 1){
-        if(n % 2 != 0){
-            return FALSE;
+/*
+ * Returns how many bytes the block at ptr can hold, which is at least the size it was
+ * allocated with.  Like malloc_usable_size, ptr is not checked.
+ *
+ * @param ptr Address returned by one of the allocation functions, or NULL.
+ * @return The usable size of the block, 0 if ptr is NULL.
+ */
+size_t sf_malloc_usable_size(void *pp){
+    if(pp == NULL){
+        return 0;
+    }
+    if(isSlabPointer(pp)){
+        return ((slab_run *) ((uintptr_t) pp & ~(PAGE_SZ - 1))) -> slotSize;
+    }
+    //a mapped block's header holds its size the same way, up to the end of its mapping
+    sf_block *block = incrementPointer(-sizeof(sf_header), pp);
+    return maskInfoBits(block -> header) - sizeof(sf_header);
+}
+
+/*
+ * Returns how many times each sf_realloc path has been taken.
+ */
+sf_realloc_counters sf_realloc_stats(){
+    return sf_stats().realloc;
+}
+
+//Take a consistent copy of an arena's statistics, filling in the bytes in use
+static sf_heap_stats snapshotStats(sf_arena *arena){
+    LOCK_ARENA(arena);
+    sf_heap_stats stats = arena -> stats;
+    memcpy(stats.quickListCapacity, arena -> quickCapacity, sizeof(stats.quickListCapacity));
+    UNLOCK_ARENA(arena);
+    if(stats.heapSize != 0){
+        //whatever is not overhead, free or on a quick list is held by the caller
+        size_t unused = PROLOGUE_OFFSET + MIN_BLOCK_SIZE + sizeof(sf_header); //prologue and epilogue
+        for(int i = 0; i < NUM_FREE_LISTS; i++){
+            unused += stats.freeBytes[i];
         }
-        n = n / 2;
+        for(int i = 0; i < NUM_QUICK_LISTS; i++){
+            unused += stats.quickListBytes[i];
+        }
+        stats.bytesInUse = stats.heapSize - unused;
     }
+    stats.bytesInUse += stats.mappedBytes;
+    return stats;
+}
 
-    return TRUE;
+/*
+ * Returns a snapshot of the allocator statistics for the heap behind sf_malloc.
+ */
+sf_heap_stats sf_stats(){
+    return snapshotStats(&mainArena);
+}
+
+//Call visit on every block of an arena in address order, the arena lock must be held
+static void walkArena(sf_arena *arena, sf_heap_visitor visit, void *arg){
+    if(!arena -> mallocInit){
+        return;
+    }
+    sf_block *block = getNextBlock(arena -> heapProPtr);
+    while(block != arena -> heapEpiPtr){
+        int state = SF_BLOCK_ALLOCATED;
+        if(((block -> header) & 0x1) == 0){
+            state = SF_BLOCK_FREE;
+        }else if(((block -> header) & 0x4) != 0){
+            state = SF_BLOCK_QUICK;
+        }
+        visit(block -> body.payload, maskInfoBits(block -> header), state, arg);
+        block = getNextBlock(block);
+    }
+}
+
+//An sf_heap_shape being filled in by addToShape, with the length of the free run the walk is in
+typedef struct {
+    sf_heap_shape shape;
+    size_t run;
+} shape_walk;
+
+//sf_heap_visitor that adds one block to a shape_walk
+static void addToShape(void *pp, size_t size, int state, void *arg){
+    shape_walk *walk = arg;
+    sf_heap_shape *shape = &(walk -> shape);
+    if(state == SF_BLOCK_ALLOCATED){
+        shape -> allocatedBlocks++;
+        shape -> allocatedBytes += size;
+        walk -> run = 0;
+        return;
+    }
+    if(state == SF_BLOCK_FREE){
+        shape -> freeBlocks++;
+        shape -> freeBytes += size;
+        if(size > shape -> largestFreeBlock){
+            shape -> largestFreeBlock = size;
+        }
+        int bucket = 64 - __builtin_clzll(size);
+        shape -> freeBlocksBySize[bucket < SF_HEAP_SIZE_BUCKETS ? bucket : SF_HEAP_SIZE_BUCKETS - 1]++;
+    }else{
+        shape -> quickListBlocks++;
+        shape -> quickListBytes += size;
+    }
+    if(walk -> run == 0){
+        shape -> freeRuns++;
+    }
+    walk -> run += size;
+    if(walk -> run > shape -> largestFreeRun){
+        shape -> largestFreeRun = walk -> run;
+    }
+}
+
+//Walk an arena's heap to find its shape
+static sf_heap_shape shapeArena(sf_arena *arena){
+    shape_walk walk;
+    memset(&walk, 0, sizeof(walk));
+    LOCK_ARENA(arena);
+    walkArena(arena, addToShape, &walk);
+    walk.shape.heapSize = arena -> stats.heapSize;
+    UNLOCK_ARENA(arena);
+    return walk.shape;
+}
+
+/*
+ * Calls visit on every block of the heap behind sf_malloc, in address order, with the
+ * block's payload, its size including the header, one of SF_BLOCK_ALLOCATED, SF_BLOCK_FREE
+ * and SF_BLOCK_QUICK, and arg.  The heap is locked during the walk, so visit must not call
+ * into sfmm.
+ */
+void sf_heap_walk(sf_heap_visitor visit, void *arg){
+    LOCK_ARENA(&mainArena);
+    walkArena(&mainArena, visit, arg);
+    UNLOCK_ARENA(&mainArena);
+}
+
+/*
+ * Walks the heap behind sf_malloc and returns its shape.
+ */
+sf_heap_shape sf_shape(){
+    return shapeArena(&mainArena);
+}
+
+/*
+ * Writes a heap shape to out as a JSON object on one line, with a member for every field of
+ * sf_heap_shape under the same name and externalFragmentation: the share of the free bytes
+ * outside the largest free block, 0 when nothing is free.  Internal fragmentation is not part
+ * of the shape, so the splinterAllocs and splinterAllocBytes totals of sf_stats are added in a
+ * separate "lifetime" member: they cover every allocation since the heap was created.
+ */
+void sf_shape_dump(const sf_heap_shape *shape, FILE *out){
+    double external = shape -> freeBytes > 0 ? 1.0 - (double) shape -> largestFreeBlock / shape -> freeBytes : 0;
+    fprintf(out, "{\"heapSize\":%zu,\"allocatedBlocks\":%zu,\"allocatedBytes\":%zu,"
+        "\"freeBlocks\":%zu,\"freeBytes\":%zu,\"largestFreeBlock\":%zu,\"externalFragmentation\":%.4f,"
+        "\"quickListBlocks\":%zu,\"quickListBytes\":%zu,\"freeRuns\":%zu,\"largestFreeRun\":%zu,"
+        "\"freeBlocksBySize\":[",
+        shape -> heapSize, shape -> allocatedBlocks, shape -> allocatedBytes, shape -> freeBlocks, shape -> freeBytes,
+        shape -> largestFreeBlock, external, shape -> quickListBlocks, shape -> quickListBytes, shape -> freeRuns,
+        shape -> largestFreeRun);
+    for(int i = 0; i < SF_HEAP_SIZE_BUCKETS; i++){
+        fprintf(out, i == 0 ? "%zu" : ",%zu", shape -> freeBlocksBySize[i]);
+    }
+    sf_heap_stats stats = sf_stats();
+    fprintf(out, "],\"lifetime\":{\"splinterAllocs\":%zu,\"splinterAllocBytes\":%zu}}\n",
+        stats.splinterAllocs, stats.splinterAllocBytes);
+}
+
+//Allocate an aligned block as described for sf_memalign, the arena lock must be held. The block is carved
+//out of one big enough for any placement: the aligned payload's offset is computed directly, and the slack in
+//front of it and behind it goes back to the free lists
+static void *memalignBlock(sf_arena *arena, size_t size, size_t align){
+    if(align < 8 || (align & (align - 1)) != 0){
+        setError(EINVAL);
+        return NULL;
+    }
+
+    if(size == 0){
+        return NULL;
+    }
+
+    if(arena == &mainArena && size >= mmapThreshold){//large requests get page aligned memory of their own
+        return align <= MAPPED_PAYLOAD_OFFSET ? mapBlock(size) : mapAlignedBlock(size, align < PAGE_SZ ? PAGE_SZ : align);
+    }
+    if(align <= BLOCK_ALIGN){//every payload is
+        return mallocBlock(arena, size);
+    }
+
+    if(size > SIZE_MAX - align - 2 * MIN_BLOCK_SIZE){
+        return malloc_err();
+    }
+    //a misaligned payload moves forward by at most align - 8 past a leading free block of at least MIN_BLOCK_SIZE
+    size_t blockSize = getRequiredBlockSize(size);
+    size_t splinterAllocs = arena -> stats.splinterAllocs;
+    size_t splinterAllocBytes = arena -> stats.splinterAllocBytes;
+    void *pp = mallocBlock(arena, blockSize + align + MIN_BLOCK_SIZE - sizeof(sf_header));
+    if(pp == NULL){ //sf_errno is set by mallocBlock
+        return NULL;
+    }
+    //any leftover of the oversized block is counted by the split below, if it is still there
+    arena -> stats.splinterAllocs = splinterAllocs;
+    arena -> stats.splinterAllocBytes = splinterAllocBytes;
+
+    sf_block *block = (sf_block *) incrementPointer(-sizeof(sf_header), pp);
+    size_t available = maskInfoBits(block -> header);
+    if((uintptr_t) pp % align != 0){
+        uintptr_t aligned = ((uintptr_t) pp + MIN_BLOCK_SIZE + align - 1) & ~(align - 1);
+        size_t offset = aligned - (uintptr_t) pp;
+        sf_block *front = block;
+        block = incrementPointer(offset, front);
+        front -> header = offset | ((front -> header) & 0x2);
+        sf_block *frontFooter = getFooterPointer(front);
+        frontFooter -> header = front -> header;
+        available -= offset;
+        block -> header = available | 0x1; //prev block is about to be free
+        insertBlockIntoFreeList(arena, front);
+    }
+    return ((sf_block *) splitBlock(arena, available, blockSize, block, (zero_range) {NULL, NULL})) -> body.payload;
 }
 
 /*
@@ -563,63 +2953,203 @@ static int isPowerOf2(int n){
  * If the allocation is not successful, then NULL is returned and sf_errno is set
  * to ENOMEM.
  */
-
 void *sf_memalign(size_t size, size_t align) {
-    if(align < 8 || !isPowerOf2(align)){
-        sf_errno = EINVAL;
+    PROFILE_START();
+    COUNT_CALLS(&mainArena, memalignCalls, 1);
+    LOCK_ARENA(&mainArena);
+    void *result = memalignBlock(&mainArena, size, align);
+    if(result == NULL && size != 0){
+        mainArena.stats.memalignFailures++;
+    }
+    UNLOCK_ARENA(&mainArena);
+    TRACE(SF_TRACE_MEMALIGN, NULL, result, size, align);
+    PROFILE_END(memalignLatency);
+    return result;
+}
+
+/*
+ * Allocates a block of memory with a specified alignment, like posix_memalign.
+ *
+ * @param memptr Where the address of the block is stored on success.
+ * @param align The alignment required, a power of two multiple of sizeof(void *).
+ * @param size The number of bytes requested to be allocated.
+ *
+ * @return 0 on success, with NULL stored when size is 0.  EINVAL if align is not valid,
+ * or ENOMEM if there is not enough memory; *memptr and sf_errno are left alone then.
+ */
+int sf_posix_memalign(void **memptr, size_t align, size_t size){
+    if(align < sizeof(void *) || (align & (align - 1)) != 0){
+        return EINVAL;
+    }
+    int savedErrno = sf_errno;
+    void *result = sf_memalign(size, align);
+    if(result == NULL && size != 0){
+        int error = sf_errno;
+        sf_errno = savedErrno;
+        return error;
+    }
+    *memptr = result;
+    return 0;
+}
+
+/*
+ * Allocates a block of memory with a specified alignment, like C11 aligned_alloc.
+ *
+ * @param align The alignment required, any power of two.
+ * @param size The number of bytes requested to be allocated.
+ *
+ * @return The block, or NULL with sf_errno set to EINVAL if align is not a power of two
+ * or to ENOMEM if there is not enough memory.  A size of 0 returns NULL.
+ */
+void *sf_aligned_alloc(size_t align, size_t size){
+    if(align == 0 || (align & (align - 1)) != 0){
+        setError(EINVAL);
         return NULL;
     }
+    return sf_memalign(size, align < 8 ? 8 : align);
+}
 
+/*
+ * Creates an arena with its own heap, free lists and quick lists.
+ *
+ * @param size The most memory the arena may use, rounded up to a whole number of pages.
+ * If size is 0, DEFAULT_ARENA_SIZE is used.
+ *
+ * @return A new arena, or NULL with sf_errno set to ENOMEM if its region cannot be mapped.
+ */
+sf_arena *sf_arena_create(size_t size){
     if(size == 0){
-        return NULL;
+        size = DEFAULT_ARENA_SIZE;
+    }
+    size_t headerSize = (sizeof(sf_arena) + 0xf) & ~(size_t) 0xf; //heap starts two-row aligned after the arena
+    size_t headerPages = (headerSize + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+    size_t regionSize = (headerSize + size + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+    void *region = sf_mmap_provider.reserve(regionSize);
+    if(region == NULL){
+        return malloc_err();
+    }
+    if(sf_mmap_provider.commit(region, headerPages) != headerPages){
+        sf_mmap_provider.release(region, regionSize);
+        return malloc_err();
     }
 
-    size_t mallocSize = size + align + MIN_BLOCK_SIZE + sizeof(sf_header);
-    void *ptr = sf_malloc(mallocSize);
-    if(ptr == NULL){
-        sf_errno = ENOMEM;
-        return NULL;
+    sf_arena *arena = (sf_arena *) region; //fresh pages are zeroed so every counter starts at 0
+    arena -> freeListHeads = arena -> ownFreeListHeads;
+    arena -> quickLists = arena -> ownQuickLists;
+    arena -> provider = &sf_mmap_provider;
+    arena -> memStart = region;
+    arena -> memEnd = incrementPointer(headerSize, region);
+    arena -> committedEnd = incrementPointer(headerPages, region);
+    arena -> memLimit = incrementPointer(regionSize, region);
+    arena -> regionSize = regionSize;
+#ifdef SF_THREADS
+    pthread_mutex_init(&arena -> lock, NULL);
+#endif
+    return arena;
+}
+
+/*
+ * Destroys an arena, releasing all of its memory at once.  Every pointer allocated
+ * from the arena becomes invalid.
+ *
+ * @param arena An arena returned by sf_arena_create, or NULL to do nothing.
+ */
+void sf_arena_destroy(sf_arena *arena){
+    if(arena == NULL){
+        return;
     }
+#ifdef SF_THREADS
+    pthread_mutex_destroy(&arena -> lock);
+#endif
+    arena -> provider -> release(arena -> memStart, arena -> regionSize);
+}
 
-    ptr = incrementPointer(-sizeof(sf_header), ptr);
-    mallocSize = maskInfoBits(((sf_block *) ptr) -> header);
+/*
+ * Same as sf_malloc, but allocates from the given arena.
+ */
+void *sf_arena_malloc(sf_arena *arena, size_t size){
+    if(size == 0)
+        return NULL;
 
-    //check if normal payload address is aligned
-    char *payload = (((sf_block *) ptr) -> body.payload);
-    if((uintptr_t) payload % align == 0){
-        printf("Aligned! %p", payload);
-    }else{
-        sf_block *block = incrementPointer(MIN_BLOCK_SIZE, ptr);
-        size_t offset = MIN_BLOCK_SIZE;
-        payload = block -> body.payload; 
-        while((uintptr_t) payload % align != 0){
-            offset++;
-            block = incrementPointer(1, block);
-            payload = block -> body.payload; 
-            if(mallocSize - offset < MIN_BLOCK_SIZE || mallocSize - offset < size + sizeof(sf_header)){
-                sf_free(ptr); 
-                sf_errno = ENOMEM;
-                return NULL;
-            }
-        }
+    LOCK_ARENA(arena);
+    arena -> stats.mallocCalls++;
+    void *pp = mallocBlock(arena, size);
+    if(pp == NULL){
+        arena -> stats.mallocFailures++;
+    }
+    UNLOCK_ARENA(arena);
+    return pp;
+}
 
-        sf_block *front = (sf_block *) ptr;
-        int prevAlloc = (front -> header) & 0x2; 
-        size_t frontSize = (offset) | prevAlloc;
-        front -> header = frontSize;
-        sf_block *frontFooter = getFooterPointer(front);
-        frontFooter -> header = frontSize;
-        block -> header = (mallocSize - offset) | 0x1;
-        insertBlockIntoFreeList(front);
-        size = size + sizeof(sf_header); //allocated blocks consists of header and payload
-        if(size < MIN_BLOCK_SIZE){
-            size = MIN_BLOCK_SIZE;
-        }else{
-            while((size & 0x7) > 0){ //make size a multiple 8 if not
-                size++;
-            }
-        }
-        return ((sf_block *) splitBlock(maskInfoBits(block -> header), size, block)) -> body.payload;
+/*
+ * Same as sf_free, but for a pointer allocated from the given arena.
+ * If ptr is invalid, the function calls abort() to exit the program.
+ */
+void sf_arena_free(sf_arena *arena, void *pp){
+    LOCK_ARENA(arena);
+    if(!validateArenaPointer(arena, pp)){
+        abort();
     }
-    return NULL;
+    arena -> stats.freeCalls++;
+    freeBlock(arena, (sf_block *) incrementPointer(-sizeof(sf_header), pp));
+    decayPurge(arena);
+    UNLOCK_ARENA(arena);
+}
+
+/*
+ * Same as sf_realloc, but for a pointer allocated from the given arena.
+ * Growing a block that cannot be grown in place moves it within the same arena.
+ */
+void *sf_arena_realloc(sf_arena *arena, void *pp, size_t rsize){
+    LOCK_ARENA(arena);
+    arena -> stats.reallocCalls++;
+    void *result = reallocBlock(arena, pp, rsize);
+    if(result == NULL && rsize != 0){
+        arena -> stats.reallocFailures++;
+    }
+    UNLOCK_ARENA(arena);
+    return result;
+}
+
+/*
+ * Same as sf_stats, for the given arena.
+ */
+sf_heap_stats sf_arena_stats(sf_arena *arena){
+    return snapshotStats(arena);
+}
+
+/*
+ * Same as sf_heap_walk, for the given arena.
+ */
+void sf_arena_heap_walk(sf_arena *arena, sf_heap_visitor visit, void *arg){
+    LOCK_ARENA(arena);
+    walkArena(arena, visit, arg);
+    UNLOCK_ARENA(arena);
+}
+
+/*
+ * Same as sf_shape, for the given arena.
+ */
+sf_heap_shape sf_arena_shape(sf_arena *arena){
+    return shapeArena(arena);
+}
+
+/*
+ * Same as sf_consolidate, but for the given arena.
+ */
+size_t sf_arena_consolidate(sf_arena *arena){
+    LOCK_ARENA(arena);
+    size_t count = consolidateArena(arena);
+    UNLOCK_ARENA(arena);
+    return count;
+}
+
+/*
+ * Same as sf_trim, but for the given arena.
+ */
+size_t sf_arena_trim(sf_arena *arena){
+    LOCK_ARENA(arena);
+    size_t released = purgeArena(arena);
+    UNLOCK_ARENA(arena);
+    return released;
 }
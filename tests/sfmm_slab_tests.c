@@ -0,0 +1,103 @@
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_util.h"
+
+/*
+ * Tests for the slabs that serve requests of up to 24 bytes, enabled by default with SF_SLABS
+ * (make slabs).
+ */
+#if defined(SF_SLABS) && !defined(SF_THREADS) && !defined(SF_TLSF)
+
+#define TEST_TIMEOUT 15
+
+Test(sfmm_slab_suite, slots_have_no_headers, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char *w = sf_malloc(4);
+	char *x = sf_malloc(4);
+	char *y = sf_malloc(16);
+	char *z = sf_malloc(16);
+
+	cr_assert_eq(x - w, 8, "4-byte slots are not 8 bytes apart!");
+	cr_assert_eq(z - y, 16, "16-byte slots are not 16 bytes apart!");
+	cr_assert_eq(((uintptr_t)w & ~(PAGE_SZ - 1)), ((uintptr_t)x & ~(PAGE_SZ - 1)), "Slots of a class are not in one run!");
+	sf_heap_stats stats = sf_stats();
+	cr_assert_eq(stats.slabUsedBytes, 48, "Wrong slab bytes in use (found=%zu)", stats.slabUsedBytes);
+	cr_assert_eq(stats.slabBytes, 5 * PAGE_SZ, "Wrong slab chunk size (found=%zu)", stats.slabBytes);
+
+	sf_free(w);
+	cr_assert_eq(sf_malloc(8), w, "Freed slot was not reused!");
+	sf_free(x);
+	sf_free(y);
+	cr_assert_eq(sf_stats().slabUsedBytes, 24, "Wrong slab bytes in use after free!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_slab_suite, many_runs, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *ptrs[1200];
+	for(int i = 0; i < 1200; i++) {
+		ptrs[i] = sf_malloc(8);
+		cr_assert_not_null(ptrs[i], "Slab allocation %d failed!", i);
+		*(long *)ptrs[i] = i;
+	}
+	for(int i = 0; i < 1200; i++)
+		cr_assert_eq(*(long *)ptrs[i], i, "Slot %d was overwritten!", i);
+	cr_assert_eq(sf_stats().slabUsedBytes, 1200 * 8, "Wrong slab bytes in use!");
+
+	for(int i = 0; i < 1200; i += 2) {
+		sf_free(ptrs[i]);
+		ptrs[i / 2] = ptrs[i + 1];
+	}
+	sf_free_batch(ptrs, 1200 / 2);
+	cr_assert_eq(sf_stats().slabUsedBytes, 0, "Slots left after freeing all of them!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_slab_suite, realloc, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char *x = sf_malloc(8);
+	memcpy(x, "abcdefg", 8);
+
+	cr_assert_eq(sf_realloc(x, 5), x, "Shrinking a slot moved it!");
+	char *y = sf_realloc(x, 20);
+	cr_assert_str_eq(y, "abcdefg", "Contents lost moving to a larger slot!");
+	char *z = sf_realloc(y, 100);
+	cr_assert_str_eq(z, "abcdefg", "Contents lost moving to the heap!");
+	cr_assert_eq(sf_stats().slabUsedBytes, 0, "Slot was not freed by realloc!");
+	cr_assert_eq(sf_shape().freeBlocks, 1, "Wrong number of free blocks!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_slab_suite, double_free, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+	sf_errno = 0;
+	void *x = sf_malloc(8);
+	/* void *y = */ sf_malloc(8);
+	sf_free(x);
+	sf_free(x);
+}
+
+Test(sfmm_slab_suite, empty_runs_purged, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *ptrs[1200];
+	for(int i = 0; i < 1200; i++)
+		ptrs[i] = sf_malloc(8);
+	sf_free_batch(ptrs, 1200);
+	cr_assert_eq(sf_stats().dirtyBytes, 3 * PAGE_SZ, "Empty runs are not counted as dirty!");
+
+	sf_trim();
+	sf_heap_stats stats = sf_stats();
+	cr_assert_eq(stats.dirtyBytes, 0, "Empty runs left dirty after a trim!");
+	cr_assert_eq(stats.purgedBytes, 3 * PAGE_SZ, "Empty runs were not purged (found=%zu)", stats.purgedBytes);
+
+	long *x = sf_malloc(16);
+	cr_assert_eq((uintptr_t)x % 16, 0, "16-byte slot is not 16 byte aligned!");
+	cr_assert_eq(*x, 0, "Purged run still holds its contents!");
+	cr_assert_eq(sf_stats().purgedBytes, 2 * PAGE_SZ, "Purged run was not reused!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+#endif /* SF_SLABS */
@@ -1,12 +1,23 @@
 #include <criterion/criterion.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <string.h>
 #include "debug.h"
 #include "sfmm.h"
 #include "sfmm_util.h"
 
 #define TEST_TIMEOUT 15
 
+/*
+ * These tests check exact heap layouts, which the per-thread caches of the
+ * thread-safe build (SF_THREADS), the default slabs of SF_SLABS and the free
+ * lists of SF_TLSF change, so they only run in the default build.  The
+ * thread-safe build is covered by sfmm_thread_tests.c, slabs by
+ * sfmm_slab_tests.c and TLSF placement by sfmm_tlsf_tests.c.
+ */
+#if !defined(SF_THREADS) && !defined(SF_SLABS) && !defined(SF_TLSF)
+
 /*
  * Assert the total number of free blocks of a specified size.
  * If size == 0, then assert the total number of all free blocks.
@@ -288,11 +299,35 @@ Test(sfmm_student_suite, quick_list_flush, .timeout = TEST_TIMEOUT) {
 	sf_free(ptr5);
 	assert_quick_list_block_count(40, 5);
 
+	// Only the three oldest blocks are flushed, they coalesce into one.
 	sf_free(ptr6);
-	assert_quick_list_block_count(40, 1);
+	assert_quick_list_block_count(40, 3);
 	assert_free_block_count(0, 2);
-	assert_free_block_count(200, 1);
+	assert_free_block_count(120, 1);
 	assert_free_block_count(3816, 1);
+	cr_assert_eq(sf_stats().quickListFlushes[1], 1, "Wrong number of flushes!");
+}
+
+Test(sfmm_student_suite, quick_list_grows_after_miss, .timeout = TEST_TIMEOUT) {
+	void *ptrs[12];
+	for(int i = 0; i < 6; i++)
+		ptrs[i] = sf_malloc(32);
+	for(int i = 0; i < 6; i++)
+		sf_free(ptrs[i]);
+	// The first flush left 3 blocks, so 3 of these hit and 3 miss.
+	for(int i = 0; i < 6; i++)
+		ptrs[i] = sf_malloc(32);
+	sf_heap_stats stats = sf_stats();
+	cr_assert_eq(stats.quickListHits[1], 3, "Wrong number of hits (found=%zu)", stats.quickListHits[1]);
+	cr_assert_eq(stats.quickListMisses[1], 9, "Wrong number of misses (found=%zu)", stats.quickListMisses[1]);
+
+	// The next time the list fills it doubles instead of flushing.
+	for(int i = 0; i < 6; i++)
+		sf_free(ptrs[i]);
+	stats = sf_stats();
+	cr_assert_eq(stats.quickListCapacity[1], 2 * QUICK_LIST_MAX, "Capacity did not grow!");
+	cr_assert_eq(stats.quickListFlushes[1], 1, "List was flushed again!");
+	assert_quick_list_block_count(40, 6);
 }
 
 Test(sfmm_student_suite, free_adjacent_corrupt, .timeout = TEST_TIMEOUT) {
@@ -417,3 +452,741 @@ Test(sfmm_student_suite, sf_memalign_regular, .timeout = TEST_TIMEOUT) {
 }
 
 
+
+Test(sfmm_student_suite, free_coalesce_unlinks_middle_of_list, .timeout = TEST_TIMEOUT) {
+	size_t sz_u = 200, sz_v = 300, sz_w = 200, sz_x = 500, sz_y = 200, sz_z = 700;
+	void *u = sf_malloc(sz_u);
+	void *v = sf_malloc(sz_v);
+	void *w = sf_malloc(sz_w);
+	/* void *x = */ sf_malloc(sz_x);
+	void *y = sf_malloc(sz_y);
+	/* void *z = */ sf_malloc(sz_z);
+
+	sf_free(y);
+	sf_free(u);
+	sf_free(w);
+	assert_free_list_size(3, 3);
+
+	//u and w are both linked behind the head of list 3 and must be unlinked when v coalesces them
+	sf_free(v);
+	assert_free_list_size(3, 1);
+	assert_free_list_size(5, 1);
+	assert_free_block_count(728, 1);
+	assert_free_block_count(0, 3);
+
+	//a request that list 3 cannot satisfy should skip straight to the coalesced block
+	void *a = sf_malloc(600);
+	cr_assert(a == u, "Allocation did not reuse the coalesced block!");
+	assert_free_list_size(5, 0);
+	assert_free_list_size(3, 1);
+}
+
+Test(sfmm_student_suite, realloc_grow_into_next_free, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(200);
+	void *y = sf_malloc(200);
+	/* void *z = */ sf_malloc(200);
+	sf_free(y);
+
+	void *x1 = sf_realloc(x, 350);
+	cr_assert(x1 == x, "Realloc did not grow the block in place!");
+	sf_block *bp = (sf_block *)((char *)x1 - sizeof(sf_header));
+	cr_assert((bp->header & ~0x7) == 360, "Realloc'ed block size not what was expected!");
+
+	// The 56 bytes left over from y become a free block between x and z.
+	assert_free_block_count(0, 2);
+	assert_free_block_count(56, 1);
+	assert_free_block_count(3432, 1);
+	sf_realloc_counters counters = sf_realloc_stats();
+	cr_assert_eq(counters.grownIntoNext, 1, "Grow into next free block was not counted!");
+	cr_assert_eq(counters.moved, 0, "Realloc should not have moved the block!");
+}
+
+Test(sfmm_student_suite, realloc_grow_with_heap, .timeout = TEST_TIMEOUT) {
+	char *x = sf_malloc(4000);
+	x[0] = 'a';
+	x[3999] = 'z';
+
+	char *x1 = sf_realloc(x, 8000);
+	cr_assert(x1 == x, "Realloc did not grow the last block in place!");
+	cr_assert(x1[0] == 'a' && x1[3999] == 'z', "Payload was not preserved!");
+	sf_block *bp = (sf_block *)((char *)x1 - sizeof(sf_header));
+	cr_assert((bp->header & ~0x7) == 8008, "Realloc'ed block size not what was expected!");
+
+	assert_free_block_count(0, 1);
+	assert_free_block_count(144, 1);
+	cr_assert(sf_mem_start() + 2 * PAGE_SZ == sf_mem_end(), "Heap grew more than necessary!");
+	cr_assert_eq(sf_realloc_stats().grownHeap, 1, "Grow with heap was not counted!");
+}
+
+Test(sfmm_student_suite, quick_list_reuse_then_free, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(32);
+	sf_free(x);
+	void *y = sf_malloc(32);
+	cr_assert(x == y, "Quick list block was not reused!");
+	sf_block *bp = (sf_block *)((char *)y - sizeof(sf_header));
+	cr_assert((bp->header & IN_QUICK_LIST) == 0, "Reused block is still marked as in a quick list!");
+
+	sf_free(y);
+	assert_quick_list_block_count(40, 1);
+}
+
+Test(sfmm_student_suite, arena_independent_heap, .timeout = TEST_TIMEOUT) {
+	sf_arena *arena = sf_arena_create(0);
+	cr_assert_not_null(arena, "Arena could not be created!");
+
+	int *x = sf_arena_malloc(arena, sizeof(int));
+	cr_assert_not_null(x, "x is NULL!");
+	*x = 4;
+	cr_assert((void *)x < sf_mem_start() || (void *)x >= sf_mem_end(), "Arena block is inside the main heap!");
+
+	// The main heap is untouched by the arena.
+	cr_assert(sf_mem_start() == sf_mem_end(), "Arena allocation grew the main heap!");
+	void *y = sf_malloc(200);
+	cr_assert_not_null(y, "y is NULL!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(3848, 1);
+
+	char *z = sf_arena_malloc(arena, 100000);
+	cr_assert_not_null(z, "Arena could not grow past the main heap limit!");
+	z[99999] = 'z';
+	z = sf_arena_realloc(arena, z, 200000);
+	cr_assert_not_null(z, "Arena realloc failed!");
+	cr_assert(z[99999] == 'z', "Arena realloc did not preserve the payload!");
+
+	sf_arena_free(arena, x);
+	sf_arena_free(arena, z);
+	sf_arena_destroy(arena);
+	sf_free(y);
+	assert_free_block_count(4056, 1);
+}
+
+Test(sfmm_student_suite, arena_size_limit, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_arena *arena = sf_arena_create(4 * PAGE_SZ);
+	cr_assert_not_null(arena, "Arena could not be created!");
+
+	void *x = sf_arena_malloc(arena, 8 * PAGE_SZ);
+	cr_assert_null(x, "Arena allocated more than its limit!");
+	cr_assert(sf_errno == ENOMEM, "sf_errno is not ENOMEM!");
+
+	x = sf_arena_malloc(arena, 2 * PAGE_SZ);
+	cr_assert_not_null(x, "Arena could not allocate within its limit!");
+	sf_arena_destroy(arena);
+}
+
+Test(sfmm_student_suite, arena_free_invalid_pointer, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+	sf_arena *arena = sf_arena_create(0);
+	sf_arena_malloc(arena, 100);
+	void *x = sf_malloc(100);
+	sf_arena_free(arena, x);
+}
+
+Test(sfmm_student_suite, malloc_batch_carves_one_block, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *ptrs[10];
+	size_t count = sf_malloc_batch(24, 10, ptrs);
+
+	cr_assert_eq(count, 10, "Wrong number of blocks allocated (exp=10, found=%zu)", count);
+	for(int i = 0; i < 10; i++) {
+		cr_assert_not_null(ptrs[i], "ptrs[%d] is NULL!", i);
+		sf_block *bp = (sf_block *)((char *)ptrs[i] - sizeof(sf_header));
+		cr_assert(bp->header & THIS_BLOCK_ALLOCATED, "Allocated bit is not set!");
+		cr_assert((bp->header & ~0x7) == 32, "Batch block size not what was expected!");
+		if(i > 0)
+			cr_assert((char *)ptrs[i] - (char *)ptrs[i - 1] == 32, "Batch blocks are not contiguous!");
+	}
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(3736, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, malloc_batch_uses_quick_list, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(24);
+	/* void *y = */ sf_malloc(24);
+	sf_free(x);
+	assert_quick_list_block_count(32, 1);
+
+	void *ptrs[3];
+	cr_assert_eq(sf_malloc_batch(24, 3, ptrs), 3, "Wrong number of blocks allocated!");
+	cr_assert(ptrs[0] == x, "Quick list block was not used first!");
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(3928, 1);
+}
+
+Test(sfmm_student_suite, malloc_batch_enomem, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *ptrs[30];
+	size_t count = sf_malloc_batch(4000, 30, ptrs);
+	cr_assert(count > 0 && count < 30, "Expected a partial batch (found=%zu)", count);
+	cr_assert_null(ptrs[count], "Unfilled entries are not NULL!");
+	cr_assert(sf_errno == ENOMEM, "sf_errno is not ENOMEM!");
+}
+
+Test(sfmm_student_suite, free_batch_coalesces_runs, .timeout = TEST_TIMEOUT) {
+	void *ptrs[8];
+	sf_malloc_batch(24, 8, ptrs);
+	void *z = sf_malloc(100);
+
+	// Free out of order, with a gap at ptrs[4] and a NULL entry.
+	void *batch[8] = { ptrs[6], ptrs[1], NULL, ptrs[0], ptrs[7], ptrs[3], ptrs[2], ptrs[5] };
+	sf_free_batch(batch, 8);
+
+	// ptrs[0..3] merge into one block of 128, ptrs[5..7] into one of 96.
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 3);
+	assert_free_block_count(128, 1);
+	assert_free_block_count(96, 1);
+
+	// Blocks without a freed neighbour in the batch go to the quick lists like sf_free.
+	void *rest[2] = { z, ptrs[4] };
+	sf_free_batch(rest, 2);
+	assert_quick_list_block_count(0, 2);
+	assert_quick_list_block_count(32, 1);
+	assert_free_block_count(0, 3);
+}
+
+Test(sfmm_student_suite, free_batch_duplicate_aborts, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+	void *x = sf_malloc(100);
+	void *batch[2] = { x, x };
+	sf_free_batch(batch, 2);
+}
+
+Test(sfmm_student_suite, free_sized_quick, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	/* void *x = */ sf_malloc(8);
+	void *y = sf_malloc(32);
+	/* void *z = */ sf_malloc(1);
+
+	sf_free_sized(y, 32);
+
+	assert_quick_list_block_count(0, 1);
+	assert_quick_list_block_count(40, 1);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(3952, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, free_sized_padded_block, .timeout = TEST_TIMEOUT) {
+	// The 3840 byte block for y would leave an 8 byte splinter, so it is padded to
+	// 3848 bytes and its size no longer follows from the requested size.
+	void *x = sf_malloc(200);
+	void *y = sf_malloc(3830);
+	sf_block *bp = (sf_block *)((char *)y - sizeof(sf_header));
+	cr_assert((bp->header & ~0x7) == 3848, "Block was not padded as expected!");
+
+	sf_free_sized(y, 3830);
+	sf_free_sized(x, 200);
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4056, 1);
+}
+
+Test(sfmm_student_suite, stats_track_heap, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_heap_stats stats = sf_stats();
+	cr_assert_eq(stats.heapSize, 0, "Heap size is not 0 before the first malloc!");
+
+	void *x = sf_malloc(200);
+	void *y = sf_malloc(32);
+	/* void *z = */ sf_malloc(1);
+	sf_free(y);
+	sf_free(x);
+	x = sf_realloc(sf_malloc(8), 100);
+	sf_malloc(86100);
+
+	stats = sf_stats();
+	cr_assert_eq(stats.mallocCalls, 5, "Wrong malloc call count (found=%zu)", stats.mallocCalls);
+	cr_assert_eq(stats.freeCalls, 2, "Wrong free call count (found=%zu)", stats.freeCalls);
+	cr_assert_eq(stats.reallocCalls, 1, "Wrong realloc call count (found=%zu)", stats.reallocCalls);
+	cr_assert_eq(stats.mallocFailures, 1, "Wrong malloc failure count (found=%zu)", stats.mallocFailures);
+	cr_assert_eq(stats.heapSize, (size_t)(sf_mem_end() - sf_mem_start()), "Wrong heap size!");
+	cr_assert_eq(stats.peakHeapSize, stats.heapSize, "Wrong peak heap size!");
+	// The failed malloc consolidated y's quick list block before trying to grow the heap.
+	cr_assert_eq(stats.quickListBytes[1], 0, "Wrong quick list bytes (found=%zu)", stats.quickListBytes[1]);
+
+	size_t freeBytes = 0;
+	for(int i = 0; i < NUM_FREE_LISTS; i++)
+		freeBytes += stats.freeBytes[i];
+	cr_assert_eq(stats.bytesInUse, 32 + 112, "Wrong bytes in use (found=%zu)", stats.bytesInUse);
+	cr_assert_eq(freeBytes + stats.bytesInUse + 40, stats.heapSize, "Free and used bytes do not add up!");
+}
+
+Test(sfmm_student_suite, malloc_huge_is_mapped, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	size_t sz = 1 << 20;
+	char *x = sf_malloc(sz);
+
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert(((uintptr_t)x & 0xf) == 0, "Mapped payload is not 16-byte aligned!");
+	memset(x, 0xab, sz);
+	cr_assert(sf_mem_start() == sf_mem_end(), "Heap grew for a mapped block!");
+	sf_heap_stats stats = sf_stats();
+	cr_assert_eq(stats.mappedBlocks, 1, "Wrong mapped block count (found=%zu)", stats.mappedBlocks);
+	cr_assert(stats.mappedBytes >= sz, "Too few mapped bytes (found=%zu)", stats.mappedBytes);
+	cr_assert_eq(stats.bytesInUse, stats.mappedBytes, "Mapped bytes are not in use!");
+
+	sf_free(x);
+	stats = sf_stats();
+	cr_assert_eq(stats.mappedBlocks, 0, "Mapped block was not unmapped!");
+	cr_assert_eq(stats.mappedBytes, 0, "Mapped bytes left after free (found=%zu)", stats.mappedBytes);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, realloc_mapped, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char *x = sf_malloc(200000);
+	for(int i = 0; i < 200000; i++)
+		x[i] = i % 251;
+
+	x = sf_realloc(x, 1 << 20);
+	cr_assert_not_null(x, "Growing a mapped block failed!");
+	for(int i = 0; i < 200000; i++)
+		cr_assert_eq(x[i], (char)(i % 251), "Contents changed at %d after growing!", i);
+
+	x = sf_realloc(x, 100);
+	cr_assert_not_null(x, "Shrinking a mapped block failed!");
+	for(int i = 0; i < 100; i++)
+		cr_assert_eq(x[i], (char)(i % 251), "Contents changed at %d after shrinking!", i);
+	cr_assert_eq(sf_stats().mappedBlocks, 0, "Small block was left mapped!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(3944, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, mmap_threshold_tunable, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	size_t old = sf_set_mmap_threshold(1024);
+	void *x = sf_malloc(2000);
+	void *y = sf_malloc(1000);
+	cr_assert_eq(sf_stats().mappedBlocks, 1, "Request above the threshold was not mapped!");
+	assert_free_block_count(3048, 1);
+
+	/* void *z = */ sf_malloc(100);
+	y = sf_realloc(y, 5000);
+	cr_assert_eq(sf_stats().mappedBlocks, 2, "Realloc above the threshold was not mapped!");
+	assert_free_block_count(1008, 1);
+	assert_free_block_count(2936, 1);
+	sf_free(x);
+	sf_free(y);
+	cr_assert_eq(sf_stats().mappedBlocks, 0, "Mapped blocks were not unmapped!");
+	cr_assert_eq(sf_set_mmap_threshold(old), 1024, "Previous threshold not returned!");
+}
+
+Test(sfmm_student_suite, extend_heap_by_shortfall, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	/* void *x = */ sf_malloc(4000);
+	void *y = sf_malloc(20000);
+
+	cr_assert_not_null(y, "y is NULL!");
+	cr_assert_eq(sf_mem_end() - sf_mem_start(), 6 * PAGE_SZ, "Heap did not grow by the shortfall!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(520, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, extend_heap_geometric, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert_eq(sf_set_heap_growth(SF_GROWTH_GEOMETRIC), SF_GROWTH_EXACT, "Exact growth is not the default!");
+	/* void *x = */ sf_malloc(4000);
+	/* void *y = */ sf_malloc(100);
+	cr_assert_eq(sf_mem_end() - sf_mem_start(), 2 * PAGE_SZ, "Heap did not double!");
+
+	/* void *z = */ sf_malloc(6000);
+	cr_assert_eq(sf_mem_end() - sf_mem_start(), 4 * PAGE_SZ, "Heap did not double!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4032 + 2 * PAGE_SZ - 6008, 1);
+
+	void *w = sf_malloc(40000);
+	cr_assert_not_null(w, "Geometric growth did not fall back to what was available!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, mmap_provider_heap, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_set_mmap_threshold(SIZE_MAX);
+	cr_assert_eq(sf_set_provider(&sf_mmap_provider), 0, "Provider could not be set before the first malloc!");
+	char *x = sf_malloc(1 << 20);
+
+	cr_assert_not_null(x, "Heap did not grow past the sfutil region!");
+	memset(x, 0xab, 1 << 20);
+	cr_assert(sf_mem_start() == sf_mem_end(), "sfutil region was used!");
+	cr_assert_eq(sf_stats().heapSize, PAGE_SZ + ((1 << 20) + 8 - 4056 + PAGE_SZ - 1) / PAGE_SZ * PAGE_SZ,
+		"Wrong heap size (found=%zu)", sf_stats().heapSize);
+	sf_free(x);
+	assert_free_block_count(0, 1);
+
+	cr_assert_eq(sf_set_provider(&sf_sfutil_provider), -1, "Provider changed while the heap was in use!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+}
+
+Test(sfmm_student_suite, trim_shrinks_heap, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(20000);
+	sf_free(x);
+	assert_free_block_count(20440, 1);
+	cr_assert(sf_stats().dirtyBytes >= 3 * PAGE_SZ, "Freed pages are not dirty (found=%zu)", sf_stats().dirtyBytes);
+
+	cr_assert_eq(sf_trim(), 4 * PAGE_SZ, "Wrong number of bytes trimmed!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4056, 1);
+	sf_heap_stats stats = sf_stats();
+	cr_assert_eq(stats.heapSize, PAGE_SZ, "Heap did not shrink (found=%zu)", stats.heapSize);
+	cr_assert_eq(stats.dirtyBytes, 0, "Dirty bytes left after trim (found=%zu)", stats.dirtyBytes);
+
+	x = sf_malloc(20000);
+	cr_assert_not_null(x, "Trimmed heap did not grow again!");
+	cr_assert_eq(sf_stats().heapSize, 5 * PAGE_SZ, "Wrong heap size after growing again!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, trim_purges_free_blocks, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(20000);
+	/* void *y = */ sf_malloc(100);
+	sf_free(x);
+	size_t dirty = sf_stats().dirtyBytes;
+	cr_assert(dirty >= 3 * PAGE_SZ, "Freed pages are not dirty (found=%zu)", dirty);
+
+	cr_assert_eq(sf_trim(), dirty, "Dirty pages were not purged!");
+	sf_heap_stats stats = sf_stats();
+	cr_assert_eq(stats.dirtyBytes, 0, "Dirty bytes left after trim (found=%zu)", stats.dirtyBytes);
+	cr_assert_eq(stats.purgedBytes, dirty, "Wrong purged bytes (found=%zu)", stats.purgedBytes);
+	assert_free_block_count(20008, 1);
+	cr_assert_eq(sf_trim(), 0, "Purged pages were purged again!");
+
+	x = sf_malloc(20000);
+	cr_assert_eq(sf_stats().purgedBytes, 0, "Reused pages still count as purged!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, purged_block_merges_purged, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(20000);
+	void *w = sf_malloc(20000);
+	/* void *y = */ sf_malloc(100);
+	sf_free(x);
+	size_t purged = sf_trim();
+	cr_assert(purged >= 3 * PAGE_SZ, "x was not purged (found=%zu)", purged);
+
+	sf_free(w); // merges with the purged x
+	sf_heap_stats stats = sf_stats();
+	cr_assert_eq(stats.dirtyBytes, 0, "Merged block counts purged pages as dirty (found=%zu)", stats.dirtyBytes);
+	cr_assert(stats.purgedBytes >= purged + 4 * PAGE_SZ, "Merged block is not purged (found=%zu)", stats.purgedBytes);
+	assert_free_block_count(40016, 1);
+	cr_assert_eq(sf_trim(), 0, "Purged pages were purged again!");
+
+	char *z = sf_malloc(40000);
+	cr_assert_eq(z[39000], 0, "Purged block does not read as zero!");
+	cr_assert_eq(sf_stats().purgedBytes, 0, "Reused pages still count as purged!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, purge_after_decay, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_set_purge(PAGE_SZ, 0);
+	void *x = sf_malloc(20000);
+	/* void *y = */ sf_malloc(100);
+	void *z = sf_malloc(100);
+	cr_assert_eq(sf_stats().dirtyBytes, 0, "Allocated pages are dirty!");
+
+	sf_free(x);
+	sf_heap_stats stats = sf_stats();
+	cr_assert_eq(stats.dirtyBytes, 0, "Dirty bytes were not purged (found=%zu)", stats.dirtyBytes);
+	cr_assert(stats.purgedBytes >= 3 * PAGE_SZ, "Too few bytes purged (found=%zu)", stats.purgedBytes);
+
+	sf_set_purge(PAGE_SZ, 60000);
+	sf_free(z);
+	x = sf_malloc(20000);
+	sf_free(x);
+	cr_assert(sf_stats().dirtyBytes >= 3 * PAGE_SZ, "Purged before the decay time!");
+}
+
+Test(sfmm_student_suite, large_blocks_best_fit, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *a = sf_malloc(12000);
+	/* void *g1 = */ sf_malloc(8);
+	void *b = sf_malloc(9000);
+	/* void *g2 = */ sf_malloc(8);
+
+	sf_free(b);
+	sf_free(a);
+	// a is at the head of the last free list, but b is the smallest block that fits.
+	void *x = sf_malloc(8500);
+	cr_assert_eq(x, b, "Large request was not given the best fit!");
+	assert_free_block_count(12008, 1);
+	assert_free_block_count(496, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, consolidate_merges_quick_lists, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *a = sf_malloc(32);
+	void *b = sf_malloc(48);
+	void *c = sf_malloc(32);
+	/* void *d = */ sf_malloc(8);
+	sf_free(b);
+	sf_free(a);
+	sf_free(c);
+	assert_quick_list_block_count(0, 3);
+
+	cr_assert_eq(sf_consolidate(), 3, "Wrong number of blocks consolidated!");
+	assert_quick_list_block_count(0, 0);
+	// a, b and c were adjacent, so they form one block with nothing else touched.
+	assert_free_block_count(0, 2);
+	assert_free_block_count(40 + 56 + 40, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, consolidate_before_growing, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	// Five blocks each of four quick list sizes fill both the lists and most of the first page.
+	void *ptrs[20];
+	for(int i = 0; i < 20; i++)
+		ptrs[i] = sf_malloc(176 - 8 * (i % 4));
+	for(int i = 0; i < 20; i++)
+		sf_free(ptrs[i]);
+	assert_quick_list_block_count(0, 20);
+	size_t heapSize = sf_stats().heapSize;
+
+	void *x = sf_malloc(2000);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert_eq(sf_stats().heapSize, heapSize, "Heap grew although consolidating made room!");
+	assert_quick_list_block_count(0, 0);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, sf_memalign_returns_slack, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *ptrs[9];
+	for(int i = 0; i < 9; i++) {
+		size_t align = (size_t)16 << i;
+		ptrs[i] = sf_memalign(100, align);
+		cr_assert_not_null(ptrs[i], "Memalign to %zu failed!", align);
+		cr_assert((uintptr_t)ptrs[i] % align == 0, "Memalign to %zu returned a misaligned address!", align);
+		memset(ptrs[i], 0xcd, 100);
+	}
+	// Each block keeps at most a remainder too small to split, the rest of the slack went back.
+	cr_assert(sf_stats().bytesInUse < 9 * (104 + 32), "Slack was not returned (in use=%zu)", sf_stats().bytesInUse);
+	for(int i = 0; i < 9; i++)
+		sf_free(ptrs[i]);
+	sf_consolidate();
+	assert_free_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, sf_memalign_large_is_mapped, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	size_t sz = 1 << 20, align = 1 << 16;
+	char *x = sf_memalign(sz, align);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert((uintptr_t)x % align == 0, "Mapped block is misaligned!");
+	memset(x, 0xab, sz);
+	cr_assert(sf_mem_start() == sf_mem_end(), "Heap grew for a mapped block!");
+	cr_assert_eq(sf_stats().mappedBlocks, 1, "Block was not mapped!");
+
+	x = sf_realloc(x, 2 * sz);
+	cr_assert_not_null(x, "Realloc of an aligned mapped block failed!");
+	cr_assert_eq(x[sz - 1], (char)0xab, "Contents lost in realloc!");
+	sf_free(x);
+	cr_assert_eq(sf_stats().mappedBytes, 0, "Mapping was not released!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, sf_posix_memalign_and_aligned_alloc, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *ptr = NULL;
+	cr_assert_eq(sf_posix_memalign(&ptr, 64, 200), 0, "posix_memalign failed!");
+	cr_assert((uintptr_t)ptr % 64 == 0, "posix_memalign returned a misaligned address!");
+	cr_assert_eq(sf_posix_memalign(&ptr, 4, 200), EINVAL, "posix_memalign accepted a bad alignment!");
+	cr_assert_eq(sf_posix_memalign(&ptr, 16, 85976), ENOMEM, "posix_memalign did not run out of memory!");
+	cr_assert(sf_errno == 0, "posix_memalign changed sf_errno!");
+
+	void *x = sf_aligned_alloc(2, 10);
+	cr_assert_not_null(x, "aligned_alloc with a small alignment failed!");
+	void *y = sf_aligned_alloc(128, 300);
+	cr_assert((uintptr_t)y % 128 == 0, "aligned_alloc returned a misaligned address!");
+	cr_assert_null(sf_aligned_alloc(24, 10), "aligned_alloc accepted a bad alignment!");
+	cr_assert(sf_errno == EINVAL, "aligned_alloc did not set sf_errno to EINVAL!");
+}
+
+Test(sfmm_student_suite, sf_calloc_skips_fresh_pages, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	size_t sz = 20000;
+	unsigned char *x = sf_calloc(sz, 1);
+	cr_assert_not_null(x, "x is NULL!");
+	for(size_t i = 0; i < sz; i++)
+		cr_assert_eq(x[i], 0, "Byte %zu is not zero!", i);
+	// everything past the block's first row of metadata came from new pages
+	cr_assert_geq(sf_stats().callocSkippedBytes, sz - 32, "Fresh pages were cleared again!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, sf_calloc_clears_dirty_region, .timeout = TEST_TIMEOUT) {
+	// sfutil takes its region from malloc on the first sf_mem_grow, so leave dirty memory behind for it.
+	unsigned char *junk = malloc(80000);
+	memset(junk, 0xAB, 80000);
+	free(junk);
+	sf_errno = 0;
+	unsigned char *x = sf_calloc(1, 2000);
+	cr_assert_not_null(x, "sf_calloc returned NULL!");
+	for(size_t i = 0; i < 2000; i++)
+		cr_assert_eq(x[i], 0, "Byte %zu is not zero!", i);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, sf_calloc_clears_reused_block, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	// a dirty block merging back into fresh memory leaves it dirty
+	unsigned char *v = sf_malloc(3000);
+	memset(v, 0xff, 3000);
+	sf_free(v);
+	v = sf_calloc(3000, 1);
+	for(size_t i = 0; i < 3000; i++)
+		cr_assert_eq(v[i], 0, "Byte %zu is not zero!", i);
+	sf_free(v);
+
+	unsigned char *x = sf_malloc(1000);
+	unsigned char *y = sf_malloc(1000);
+	/* void *z = */ sf_malloc(8);
+	memset(x, 0xff, 1000);
+	memset(y, 0xff, 1000);
+	sf_free(x);
+	sf_free(y);
+
+	unsigned char *w = sf_calloc(250, 8);
+	cr_assert_eq(w, x, "Freed block was not reused!");
+	for(size_t i = 0; i < 2000; i++)
+		cr_assert_eq(w[i], 0, "Byte %zu is not zero!", i);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, sf_calloc_overflow, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert_null(sf_calloc(SIZE_MAX / 2, 3), "Overflowing calloc returned memory!");
+	cr_assert(sf_errno == ENOMEM, "sf_errno is not ENOMEM!");
+	cr_assert_null(sf_calloc(0, 16), "calloc of no elements returned memory!");
+}
+
+Test(sfmm_student_suite, sf_malloc_usable_size, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(10);
+	cr_assert_eq(sf_malloc_usable_size(x), 24, "Usable size of a minimum block is wrong!");
+	void *y = sf_malloc(1000);
+	cr_assert_eq(sf_malloc_usable_size(y), 1000, "Usable size of an exact block is wrong!");
+	size_t sz = 1 << 20;
+	void *z = sf_malloc(sz);
+	cr_assert(sf_malloc_usable_size(z) >= sz && sf_malloc_usable_size(z) < sz + PAGE_SZ,
+		  "Usable size of a mapped block is wrong!");
+	cr_assert_eq(sf_malloc_usable_size(NULL), 0, "Usable size of NULL is not 0!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, realloc_into_slack, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *a = sf_malloc(200);
+	sf_malloc(200);
+	sf_free(a);
+	char *x = sf_malloc(180); // a 208 byte block, too little is left to split off
+	size_t usable = sf_malloc_usable_size(x);
+	cr_assert_eq(usable, 200, "Usable size does not include the slack!");
+	memset(x, 'x', usable);
+
+	cr_assert_eq(sf_realloc(x, usable), x, "Realloc into the slack moved the block!");
+	cr_assert_eq(sf_realloc(x, 190), x, "Realloc within the slack moved the block!");
+	cr_assert_eq(sf_malloc_usable_size(x), usable, "Realloc within the slack changed the block!");
+	cr_assert(x[usable - 1] == 'x', "Payload was not preserved!");
+	cr_assert_eq(sf_realloc_stats().fitted, 2, "Realloc into the slack was not counted!");
+	cr_assert_eq(sf_stats().splinterAllocs, 1, "Realloc into the slack counted the splinter again!");
+
+	// A mapped block keeps its mapping for a size that needs the same pages.
+	size_t sz = 1 << 20;
+	char *y = sf_malloc(sz);
+	usable = sf_malloc_usable_size(y);
+	cr_assert_eq(sf_realloc(y, usable), y, "Realloc into the last page moved the block!");
+	cr_assert_eq(sf_stats().mappedBlocks, 1, "Mapped block was remapped!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+static void sumBlocks(void *pp, size_t size, int state, void *arg) {
+	((size_t *)arg)[state] += size;
+}
+
+Test(sfmm_student_suite, sf_shape_free_runs, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(16);
+	void *a = sf_malloc(200);
+	sf_malloc(200);
+	void *c = sf_malloc(200);
+	sf_malloc(200);
+	sf_free(a);
+	sf_free(x); // onto a quick list, next to a
+	sf_free(c);
+
+	sf_heap_shape shape = sf_shape();
+	cr_assert_eq(shape.allocatedBlocks, 2, "Wrong number of allocated blocks!");
+	cr_assert_eq(shape.freeBlocks, 3, "Wrong number of free blocks!");
+	cr_assert_eq(shape.quickListBlocks, 1, "Wrong number of quick list blocks!");
+	cr_assert_eq(shape.quickListBytes, 32, "Wrong number of quick list bytes!");
+	cr_assert_eq(shape.freeRuns, 3, "x and a should form one run!");
+	cr_assert_eq(shape.largestFreeBlock, shape.freeBytes - 2 * 208, "Largest free block is wrong!");
+	size_t buckets = 0;
+	for(int i = 0; i < SF_HEAP_SIZE_BUCKETS; i++)
+		buckets += shape.freeBlocksBySize[i];
+	cr_assert_eq(buckets, shape.freeBlocks, "Histogram does not cover every free block!");
+	cr_assert_eq(shape.freeBlocksBySize[8], 2, "208 byte blocks are in the wrong bucket!");
+
+	size_t bytes[3] = { 0 };
+	sf_heap_walk(sumBlocks, bytes);
+	cr_assert_eq(bytes[SF_BLOCK_ALLOCATED], shape.allocatedBytes, "Walk disagrees on allocated bytes!");
+	cr_assert_eq(bytes[SF_BLOCK_FREE] + bytes[SF_BLOCK_QUICK] + bytes[SF_BLOCK_ALLOCATED],
+		     shape.heapSize - 40, "Walk does not cover the heap!");
+
+	sf_malloc(180); // a 192 byte block from a 208 byte one
+	sf_heap_stats stats = sf_stats();
+	cr_assert_eq(stats.splinterAllocs, 1, "Splinter was not counted!");
+	cr_assert_eq(stats.splinterAllocBytes, 16, "Wrong number of splinter bytes!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, sf_shape_dump_json, .timeout = TEST_TIMEOUT) {
+	void *a = sf_malloc(200);
+	sf_malloc(100);
+	sf_free(a);
+	sf_malloc(180); // a 208 byte block with a 16 byte splinter
+	sf_heap_shape shape = sf_shape();
+	FILE *out = tmpfile();
+	sf_shape_dump(&shape, out);
+	char line[1024] = { 0 };
+	rewind(out);
+	cr_assert_not_null(fgets(line, sizeof(line), out), "Nothing was written!");
+	fclose(out);
+	cr_assert(strncmp(line, "{\"heapSize\":", 12) == 0, "Dump is not a JSON object: %s", line);
+	cr_assert(strstr(line, "\"externalFragmentation\":0.0000") != NULL, "One free block is not fragmented!");
+	cr_assert(strstr(line, "\"lifetime\":{\"splinterAllocs\":1,\"splinterAllocBytes\":16}") != NULL,
+		  "Splinter totals are missing: %s", line);
+	cr_assert(strcmp(line + strlen(line) - 3, "}}\n") == 0, "Dump is not one line: %s", line);
+}
+
+#ifdef SF_PROFILE
+Test(sfmm_student_suite, sf_profile_counts_calls, .timeout = TEST_TIMEOUT) {
+	sf_profile_reset();
+	void *x = sf_malloc(100);
+	void *y = sf_malloc(200);
+	sf_free(x);
+	sf_free(y);
+	x = sf_malloc(100);
+	sf_profile stats = sf_profile_stats();
+	cr_assert_eq(stats.mallocLatency.count, 3, "Wrong number of mallocs profiled!");
+	cr_assert_eq(stats.freeLatency.count, 2, "Wrong number of frees profiled!");
+	cr_assert_eq(stats.quickListHit.count, 1, "The quick list hit was not profiled!");
+	uint64_t inBuckets = 0;
+	for(int i = 0; i < SF_PROFILE_BUCKETS; i++)
+		inBuckets += stats.mallocLatency.buckets[i];
+	cr_assert_eq(inBuckets, 3, "Histogram buckets do not add up to the count!");
+	sf_profile_reset();
+	cr_assert_eq(sf_profile_stats().mallocLatency.count, 0, "Reset did not clear the counts!");
+}
+#endif
+
+#endif /* SF_THREADS || SF_SLABS || SF_TLSF */
@@ -0,0 +1,155 @@
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_util.h"
+
+/*
+ * Tests for the thread-safe build, enabled with SF_THREADS (make threads).
+ */
+#ifdef SF_THREADS
+
+#define TEST_TIMEOUT 15
+#define NUM_THREADS 4
+#define NUM_ROUNDS 20000
+#define NUM_SLOTS 16
+
+/*
+ * Repeatedly allocate, fill, check and free small blocks, with some realloc
+ * traffic mixed in, from several threads at once.  Each byte of a block is
+ * filled with the thread's id so that overlapping blocks are detected.
+ */
+static void *churn(void *arg) {
+	unsigned char id = (unsigned char)(uintptr_t)arg;
+	unsigned char *slots[NUM_SLOTS] = { NULL };
+	size_t sizes[NUM_SLOTS] = { 0 };
+	unsigned int seed = id;
+
+	for(int i = 0; i < NUM_ROUNDS; i++) {
+	    int s = rand_r(&seed) % NUM_SLOTS;
+	    if(slots[s] != NULL) {
+		for(size_t j = 0; j < sizes[s]; j++) {
+		    if(slots[s][j] != id)
+			return (void *)1;
+		}
+		if(i % 7 == 0) {
+		    sizes[s] = sizes[s] * 2;
+		    slots[s] = sf_realloc(slots[s], sizes[s]);
+		    if(slots[s] == NULL)
+			return (void *)1;
+		    memset(slots[s], id, sizes[s]);
+		    continue;
+		}
+		sf_free(slots[s]);
+		slots[s] = NULL;
+	    } else {
+		sizes[s] = 1 + rand_r(&seed) % 150;
+		slots[s] = sf_malloc(sizes[s]);
+		if(slots[s] == NULL)
+		    return (void *)1;
+		memset(slots[s], id, sizes[s]);
+	    }
+	}
+	for(int s = 0; s < NUM_SLOTS; s++) {
+	    if(slots[s] != NULL)
+		sf_free(slots[s]);
+	}
+	return NULL;
+}
+
+Test(sfmm_thread_suite, concurrent_malloc_free, .timeout = TEST_TIMEOUT) {
+	pthread_t threads[NUM_THREADS];
+	for(int i = 0; i < NUM_THREADS; i++)
+	    pthread_create(&threads[i], NULL, churn, (void *)(uintptr_t)(i + 1));
+	for(int i = 0; i < NUM_THREADS; i++) {
+	    void *result;
+	    pthread_join(threads[i], &result);
+	    cr_assert_null(result, "Thread %d saw a corrupted or failed allocation!", i);
+	}
+}
+
+Test(sfmm_thread_suite, thread_cache_drained_on_exit, .timeout = TEST_TIMEOUT) {
+	pthread_t thread;
+	pthread_create(&thread, NULL, churn, (void *)(uintptr_t)1);
+	pthread_join(thread, NULL);
+
+	// Everything the thread cached went back to the heap, so the blocks coalesce again.
+	int cnt = 0;
+#ifdef SF_TLSF
+	// TLSF keeps its own lists, the byte counts still cover every free block.
+	sf_heap_stats stats = sf_stats();
+	for(int i = 0; i < NUM_FREE_LISTS; i++)
+	    cnt += stats.freeBytes[i] > 0;
+#else
+	for(int i = 0; i < NUM_FREE_LISTS; i++) {
+	    sf_block *bp = sf_free_list_heads[i].body.links.next;
+	    while(bp != &sf_free_list_heads[i]) {
+		cnt++;
+		bp = bp->body.links.next;
+	    }
+	}
+#endif
+	sf_heap_stats capacities = sf_stats();
+	int overfull = 0;
+	for(int i = 0; i < NUM_QUICK_LISTS; i++)
+	    overfull += sf_quick_lists[i].length > capacities.quickListCapacity[i];
+	cr_assert(cnt >= 1, "No free blocks after the thread exited!");
+	cr_assert(overfull == 0, "Quick lists overfull!");
+}
+
+static void *freeArg(void *arg) {
+	sf_free(arg);
+	return NULL;
+}
+
+Test(sfmm_thread_suite, double_free_across_threads, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+	void *x = sf_malloc(64);
+	sf_free(x); // into this thread's cache
+	pthread_t thread;
+	pthread_create(&thread, NULL, freeArg, x);
+	pthread_join(thread, NULL);
+}
+
+static pthread_key_t lateFreeKey;
+static int lateFreeRounds;
+
+// Runs in the second round of destructors, after the thread's cache was released in the first.
+static void lateFree(void *pp) {
+	if(lateFreeRounds++ == 0) {
+	    pthread_setspecific(lateFreeKey, pp);
+	    return;
+	}
+	sf_free(pp);
+}
+
+static void *freeInDestructor(void *arg) {
+	void *x = sf_malloc(64);
+	sf_free(sf_malloc(64)); // sets up the thread's cache
+	pthread_setspecific(lateFreeKey, x);
+	return x;
+}
+
+static void findBlockState(void *pp, size_t size, int state, void *arg) {
+	void **found = arg;
+	if((char *)found[0] >= (char *)pp && (char *)found[0] < (char *)pp + size)
+	    found[1] = (void *)(uintptr_t)state; // the block holding x, which may have merged with its neighbours
+}
+
+Test(sfmm_thread_suite, free_after_cache_released, .timeout = TEST_TIMEOUT) {
+	pthread_key_create(&lateFreeKey, lateFree);
+	pthread_t thread;
+	void *x;
+	pthread_create(&thread, NULL, freeInDestructor, NULL);
+	pthread_join(thread, &x);
+	cr_assert_eq(lateFreeRounds, 2, "The late free did not run!");
+
+	sf_consolidate(); // empties the quick lists, so only a thread cache could still hold the block
+	void *found[2] = { x, (void *)(uintptr_t)SF_BLOCK_ALLOCATED };
+	sf_heap_walk(findBlockState, found);
+	cr_assert_eq((uintptr_t)found[1], SF_BLOCK_FREE, "Block freed after the cache was released was not freed!");
+}
+
+#endif /* SF_THREADS */
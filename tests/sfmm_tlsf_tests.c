@@ -0,0 +1,84 @@
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <string.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_util.h"
+
+/*
+ * Tests for two-level segregated fit placement, enabled with SF_TLSF (make tlsf).
+ */
+#if defined(SF_TLSF) && !defined(SF_THREADS)
+
+#define TEST_TIMEOUT 15
+
+// rand_r is not in C99, a linear congruential generator is enough here.
+static unsigned int next_random(unsigned int *seed) {
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 16;
+}
+
+Test(sfmm_tlsf_suite, good_fit, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *a = sf_malloc(200);
+	/* void *g1 = */ sf_malloc(8);
+	void *b = sf_malloc(300);
+	/* void *g2 = */ sf_malloc(8);
+	void *c = sf_malloc(1000);
+	/* void *g3 = */ sf_malloc(8);
+
+	sf_free(c);
+	sf_free(b);
+	sf_free(a);
+	// 264 bytes rounds up past the list holding a's 208-byte block, b's 312-byte block is the first that fits.
+	cr_assert_eq(sf_malloc(256), b, "Request was not served from the next big enough list!");
+	cr_assert_eq(sf_malloc(190), a, "Request was not served from the smallest list that fits!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_tlsf_suite, uses_block_in_own_list, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	// The whole first page is one 4056-byte block, which sits in the list the request rounds up past.
+	void *x = sf_malloc(4048);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert_eq(sf_stats().heapSize, PAGE_SZ, "Heap grew although a free block fit!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_tlsf_suite, random_traffic, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_set_slab_max(0); // slab chunks stay in use once made
+	unsigned char *slots[64] = { NULL };
+	size_t sizes[64] = { 0 };
+	unsigned int seed = 1;
+
+	for(int i = 0; i < 20000; i++) {
+	    int s = next_random(&seed) % 64;
+	    if(slots[s] != NULL) {
+		for(size_t j = 0; j < sizes[s]; j++)
+		    cr_assert_eq(slots[s][j], (unsigned char)s, "Block %d was overwritten!", s);
+		if(i % 5 == 0) {
+		    sizes[s] = 1 + next_random(&seed) % 1500;
+		    slots[s] = sf_realloc(slots[s], sizes[s]);
+		    cr_assert_not_null(slots[s], "realloc failed!");
+		    memset(slots[s], s, sizes[s]);
+		    continue;
+		}
+		sf_free(slots[s]);
+		slots[s] = NULL;
+	    } else {
+		sizes[s] = 1 + next_random(&seed) % 1500;
+		slots[s] = sf_malloc(sizes[s]);
+		cr_assert_not_null(slots[s], "malloc failed!");
+		memset(slots[s], s, sizes[s]);
+	    }
+	}
+	for(int s = 0; s < 64; s++) {
+	    if(slots[s] != NULL)
+		sf_free(slots[s]);
+	}
+	cr_assert_eq(sf_stats().bytesInUse, 0, "Bytes still in use after freeing everything!");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+#endif /* SF_TLSF && !SF_THREADS */
@@ -0,0 +1,64 @@
+#define _DEFAULT_SOURCE //for setenv and mkstemp
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_util.h"
+
+/*
+ * Tests for trace recording, enabled with SF_TRACE (make trace).
+ */
+#ifdef SF_TRACE
+
+#define TEST_TIMEOUT 15
+
+Test(sfmm_trace_suite, round_trip, .timeout = TEST_TIMEOUT) {
+	char path[] = "/tmp/sfmm_trace_XXXXXX";
+	int fd = mkstemp(path);
+	cr_assert(fd >= 0, "Could not create a trace file!");
+	close(fd);
+	setenv("SF_TRACE_FILE", path, 1);
+
+	void *x = sf_malloc(100);
+	void *y = sf_realloc(x, 200);
+	void *z = sf_memalign(128, 64);
+	sf_free(y);
+	sf_free(z);
+	sf_trace_flush();
+
+	FILE *in = fopen(path, "rb");
+	cr_assert_not_null(in, "Trace file was not written!");
+	sf_trace_header header;
+	cr_assert_eq(fread(&header, sizeof(header), 1, in), 1, "Trace header is missing!");
+	cr_assert_eq(header.magic, SF_TRACE_MAGIC, "Wrong trace magic!");
+	cr_assert_eq(header.recordSize, sizeof(sf_trace_record), "Wrong trace record size!");
+
+	sf_trace_record records[6];
+	size_t n = fread(records, sizeof(sf_trace_record), 6, in);
+	fclose(in);
+	unlink(path);
+	cr_assert_eq(n, 5, "Wrong number of trace records (found=%zu)", n);
+
+	sf_trace_record expected[5] = {
+		{ .op = SF_TRACE_MALLOC, .size = 100, .ptr = 0, .result = (uintptr_t)x },
+		{ .op = SF_TRACE_REALLOC, .size = 200, .ptr = (uintptr_t)x, .result = (uintptr_t)y },
+		{ .op = SF_TRACE_MEMALIGN, .size = 128, .align = 64, .ptr = 0, .result = (uintptr_t)z },
+		{ .op = SF_TRACE_FREE, .size = 0, .ptr = (uintptr_t)y, .result = 0 },
+		{ .op = SF_TRACE_FREE, .size = 0, .ptr = (uintptr_t)z, .result = 0 },
+	};
+	for(int i = 0; i < 5; i++) {
+		cr_assert_eq(records[i].op, expected[i].op, "Record %d has the wrong op!", i);
+		cr_assert_eq(records[i].size, expected[i].size, "Record %d has the wrong size!", i);
+		cr_assert_eq(records[i].align, expected[i].align, "Record %d has the wrong alignment!", i);
+		cr_assert_eq(records[i].ptr, expected[i].ptr, "Record %d has the wrong pointer!", i);
+		cr_assert_eq(records[i].result, expected[i].result, "Record %d has the wrong result!", i);
+		if(i > 0)
+			cr_assert(records[i].timestamp >= records[i - 1].timestamp, "Record %d is out of order!", i);
+	}
+}
+
+#endif /* SF_TRACE */